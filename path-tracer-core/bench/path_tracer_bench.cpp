@@ -0,0 +1,490 @@
+#include <benchmark/benchmark.h>
+
+#include "path_tracer/core/bvh.hpp"
+#include "path_tracer/core/mesh.hpp"
+#include "path_tracer/core/renderer.hpp"
+#include "path_tracer/geometry/aabb.hpp"
+#include "path_tracer/geometry/triangle.hpp"
+#include "path_tracer/geometry/triangle_packet.hpp"
+#include "path_tracer/scene/camera.hpp"
+#include "path_tracer/scene/model.hpp"
+
+#include "cloud/ray_wire.hpp"
+
+using namespace math;
+
+// Microbenchmarks for the intersection kernels and the ray_wire codec on the bundled scenes
+//
+// Every benchmark traces a fixed set of rays per iteration and reports Mrays/s,
+// set PATH_TRACER_SCENES to run against a different scenes directory
+namespace bench {
+	static constexpr uint32_t ray_count = 4096;
+	static const uvec2 camera_resolution = uvec2(320, 180);
+
+	// Rays per ray_wire frame, the default stage batch size
+	static constexpr size_t wire_batch_size = 256;
+
+	struct instance {
+		std::shared_ptr<scene::model> model;
+		scene::transform transform;
+		scene::transform inv_transform;
+	};
+
+	struct scene_data {
+		core::renderer renderer;
+		std::vector<std::shared_ptr<core::mesh>> meshes;
+
+		// Baked the same way as distributed_scene
+		std::vector<instance> instances;
+		core::bvh tlas;
+
+		std::vector<geometry::ray> camera_rays;
+	};
+
+	static std::filesystem::path get_scenes_directory() {
+		if (const char* directory = std::getenv("PATH_TRACER_SCENES"))
+			return directory;
+
+		return PATH_TRACER_SCENES_DIR;
+	}
+
+	// Missing buffers would load as empty meshes, so check for them up front
+	static std::string find_missing_buffer(const std::filesystem::path& path) {
+		cgltf_options options = {};
+		cgltf_data* data = nullptr;
+
+		if (cgltf_parse_file(&options, path.string().c_str(), &data) != cgltf_result_success)
+			return path.string();
+
+		std::string missing;
+		for (size_t i = 0; i < data->buffers_count && missing.empty(); i++) {
+			std::filesystem::path buffer_path = path.parent_path() / data->buffers[i].uri;
+			if (!std::filesystem::exists(buffer_path))
+				missing = buffer_path.string();
+		}
+
+		cgltf_free(data);
+		return missing;
+	}
+
+	static void bake_scene(scene_data& scene) {
+		std::vector<scene::entity*> stack;
+		for (const auto& [_, entity] : scene.renderer.entities)
+			stack.push_back(entity.get());
+
+		std::vector<core::bvh::primitive> primitives;
+
+		while (!stack.empty()) {
+			scene::entity* entity = stack.back();
+			stack.pop_back();
+
+			for (const auto& child : entity->get_children())
+				stack.push_back(child.get());
+
+			auto model = entity->get_component<scene::model>();
+			if (!model || model->surfaces.empty())
+				continue;
+
+			for (const auto& surface : model->surfaces)
+				scene.meshes.push_back(surface.mesh);
+
+			scene::transform transform = entity->get_global_transform();
+
+			geometry::aabb world_aabb;
+			for (uint8_t corner = 0; corner < 8; corner++) {
+				fvec3 point = transform * fvec3(
+					corner & 1 ? model->aabb.max.x : model->aabb.min.x,
+					corner & 2 ? model->aabb.max.y : model->aabb.min.y,
+					corner & 4 ? model->aabb.max.z : model->aabb.min.z);
+
+				if (corner == 0)
+					world_aabb = {point, point};
+				else
+					world_aabb.add(point);
+			}
+
+			scene.instances.push_back({model, transform, transform.inverse()});
+			primitives.push_back({world_aabb, (world_aabb.min + world_aabb.max) * 0.5F});
+		}
+
+		scene.tlas.build(primitives, 1);
+
+		auto camera = scene.renderer.camera->get_component<scene::camera>();
+		float ratio = static_cast<float>(camera_resolution.x) / camera_resolution.y;
+
+		for (uint32_t y = 0; y < camera_resolution.y; y++) {
+			for (uint32_t x = 0; x < camera_resolution.x; x++) {
+				fvec2 ndc = ((fvec2(uvec2(x, y)) + fvec2(0.5F)) / camera_resolution) * 2 - fvec2::one;
+				ndc.y = -ndc.y;
+				scene.camera_rays.push_back(camera->get_ray(ndc, ratio));
+			}
+		}
+	}
+
+	// Loaded once and shared by every benchmark, nullptr with a reason when unavailable
+	static scene_data* get_scene(const std::string& name, std::string& error) {
+		static std::map<std::string, std::unique_ptr<scene_data>> scenes;
+		static std::map<std::string, std::string> errors;
+
+		if (scenes.contains(name)) {
+			error = errors[name];
+			return scenes[name].get();
+		}
+
+		std::filesystem::path directory = get_scenes_directory() / name;
+		std::filesystem::path path;
+
+		if (std::filesystem::is_directory(directory)) {
+			for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+				if (entry.path().extension() == ".gltf")
+					path = entry.path();
+			}
+		}
+
+		if (path.empty())
+			errors[name] = "No .gltf file in " + directory.string();
+		else if (std::string missing = find_missing_buffer(path); !missing.empty())
+			errors[name] = "Missing scene buffer " + missing;
+
+		if (errors[name].empty()) {
+			auto scene = std::make_unique<scene_data>();
+			scene->renderer.load_gltf(path);
+			bake_scene(*scene);
+			scenes[name] = std::move(scene);
+		}
+		else
+			scenes[name] = nullptr;
+
+		error = errors[name];
+		return scenes[name].get();
+	}
+
+	static core::mesh& get_largest_mesh(scene_data& scene) {
+		return **std::max_element(scene.meshes.begin(), scene.meshes.end(),
+		                          [](const auto& x, const auto& y) {
+			                          return x->triangles.size() < y->triangles.size();
+		                          });
+	}
+
+	static void use_acceleration(scene_data& scene, core::acceleration_structure acceleration) {
+		for (const auto& mesh : scene.meshes) {
+			if (mesh->acceleration == acceleration)
+				continue;
+
+			if (acceleration == core::acceleration_structure::bvh)
+				mesh->build_bvh();
+			else
+				mesh->build_kd_tree();
+		}
+	}
+
+	// Origins inside the mesh bounds with uniformly random directions
+	static std::vector<geometry::ray> get_mesh_rays(const core::mesh& mesh) {
+		std::mt19937 rng{42};
+		std::uniform_real_distribution<float> uniform{0, 1};
+
+		std::vector<geometry::ray> rays;
+		rays.reserve(ray_count);
+
+		for (uint32_t i = 0; i < ray_count; i++) {
+			fvec3 t(uniform(rng), uniform(rng), uniform(rng));
+			fvec3 dir(uniform(rng) * 2 - 1, uniform(rng) * 2 - 1, uniform(rng) * 2 - 1);
+			rays.emplace_back(mesh.aabb.min + (mesh.aabb.max - mesh.aabb.min) * t, dir);
+		}
+
+		return rays;
+	}
+
+	static void set_mrays(benchmark::State& state, size_t rays_per_iteration) {
+		// Rate counters are divided by elapsed time, so this reads as Mrays/s
+		state.counters["Mrays"] = benchmark::Counter(
+			static_cast<double>(state.iterations()) * rays_per_iteration / 1e6,
+			benchmark::Counter::kIsRate);
+	}
+
+	static void triangle_intersect(benchmark::State& state, const std::string& scene_name) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		core::mesh& mesh = get_largest_mesh(*scene);
+		auto rays = get_mesh_rays(mesh);
+
+		std::vector<geometry::triangle> triangles;
+		for (const uvec3& indices : mesh.triangles) {
+			triangles.emplace_back(
+				mesh.vertices[indices.x].position,
+				mesh.vertices[indices.y].position,
+				mesh.vertices[indices.z].position);
+		}
+
+		for (auto _ : state) {
+			for (size_t i = 0; i < rays.size(); i++)
+				benchmark::DoNotOptimize(triangles[i % triangles.size()].intersect(rays[i]));
+		}
+
+		set_mrays(state, rays.size());
+	}
+
+	// One ray against eight triangles per call, as in kD tree leaves
+	static void triangle_packet_intersect(benchmark::State& state, const std::string& scene_name) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		core::mesh& mesh = get_largest_mesh(*scene);
+		use_acceleration(*scene, core::acceleration_structure::kd_tree);
+		auto rays = get_mesh_rays(mesh);
+
+		const auto& packets = mesh.kd_tree.packets;
+
+		for (auto _ : state) {
+			for (size_t i = 0; i < rays.size(); i++) {
+				benchmark::DoNotOptimize(packets[i % packets.size()].intersect(
+					rays[i], std::numeric_limits<float>::max()));
+			}
+		}
+
+		set_mrays(state, rays.size());
+	}
+
+	static void aabb_intersect(benchmark::State& state, const std::string& scene_name) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		core::mesh& mesh = get_largest_mesh(*scene);
+		use_acceleration(*scene, core::acceleration_structure::bvh);
+		auto rays = get_mesh_rays(mesh);
+
+		std::vector<fvec3> inv_dirs;
+		for (const auto& ray : rays)
+			inv_dirs.push_back(fvec3::one / ray.get_dir());
+
+		const auto& nodes = mesh.bvh.nodes;
+
+		for (auto _ : state) {
+			for (size_t i = 0; i < rays.size(); i++)
+				benchmark::DoNotOptimize(nodes[i % nodes.size()].aabb.intersect(rays[i], inv_dirs[i]));
+		}
+
+		set_mrays(state, rays.size());
+	}
+
+	static void mesh_intersect(benchmark::State& state, const std::string& scene_name,
+	                           core::acceleration_structure acceleration) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		core::mesh& mesh = get_largest_mesh(*scene);
+		use_acceleration(*scene, acceleration);
+		auto rays = get_mesh_rays(mesh);
+
+		for (auto _ : state) {
+			for (const auto& ray : rays)
+				benchmark::DoNotOptimize(mesh.intersect(ray));
+		}
+
+		set_mrays(state, rays.size());
+	}
+
+	// Primary camera rays through the top-level BVH, like distributed_scene::intersect_nearest
+	static void scene_intersect(benchmark::State& state, const std::string& scene_name,
+	                            core::acceleration_structure acceleration) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		use_acceleration(*scene, acceleration);
+
+		for (auto _ : state) {
+			for (const auto& ray : scene->camera_rays) {
+				float nearest_dist = -1;
+
+				scene->tlas.traverse(ray, [&](uint32_t index) {
+					const instance& instance = scene->instances[index];
+					auto hit = instance.model->intersect(ray, instance.transform, instance.inv_transform);
+
+					if (hit.has_hit() && (hit.distance < nearest_dist || nearest_dist < 0))
+						nearest_dist = hit.distance;
+
+					return nearest_dist;
+				});
+
+				benchmark::DoNotOptimize(nearest_dist);
+			}
+		}
+
+		set_mrays(state, scene->camera_rays.size());
+	}
+
+	// Same rays in packets through the top-level BVH, like distributed_scene::intersect_batch
+	static void scene_intersect_packet(benchmark::State& state, const std::string& scene_name,
+	                                   core::acceleration_structure acceleration) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		use_acceleration(*scene, acceleration);
+
+		const auto& rays = scene->camera_rays;
+		std::array<float, core::bvh::packet_width> nearest_dists;
+
+		for (auto _ : state) {
+			for (size_t begin = 0; begin < rays.size(); begin += core::bvh::packet_width) {
+				size_t count = std::min<size_t>(core::bvh::packet_width, rays.size() - begin);
+				std::span<const geometry::ray> packet(rays.data() + begin, count);
+				nearest_dists.fill(-1);
+
+				scene->tlas.traverse_packet(packet, [&](uint32_t ray_index, uint32_t index) {
+					const instance& instance = scene->instances[index];
+					auto hit = instance.model->intersect(packet[ray_index], instance.transform, instance.inv_transform);
+
+					float& nearest_dist = nearest_dists[ray_index];
+					if (hit.has_hit() && (hit.distance < nearest_dist || nearest_dist < 0))
+						nearest_dist = hit.distance;
+
+					return nearest_dist;
+				});
+
+				benchmark::DoNotOptimize(nearest_dists);
+			}
+		}
+
+		set_mrays(state, rays.size());
+	}
+
+	// Nearest hits of the camera rays, shaped like the replies workers send back
+	static std::vector<models::intersect_reply> get_intersect_replies(scene_data& scene) {
+		std::vector<models::intersect_reply> replies;
+
+		for (const auto& ray : scene.camera_rays) {
+			float nearest_dist = -1;
+
+			scene.tlas.traverse(ray, [&](uint32_t index) {
+				const instance& instance = scene.instances[index];
+				auto hit = instance.model->intersect(ray, instance.transform, instance.inv_transform);
+
+				if (hit.has_hit() && (hit.distance < nearest_dist || nearest_dist < 0))
+					nearest_dist = hit.distance;
+
+				return nearest_dist;
+			});
+
+			models::intersect_reply reply{static_cast<uint32_t>(replies.size())};
+			reply.result.hit = nearest_dist >= 0;
+			reply.result.distance = reply.result.hit ? nearest_dist : std::numeric_limits<float>::max();
+
+			if (reply.result.hit)
+				reply.result.surface = {ray.origin + ray.get_dir() * nearest_dist, -ray.get_dir(), fvec3(0.8F), fvec3::zero, 1, 0.5F, 0, 1.5F, false};
+
+			replies.push_back(reply);
+		}
+
+		return replies;
+	}
+
+	// Intersection replies encoded in stage sized batches, as a peer sends them
+	static void wire_encode(benchmark::State& state, const std::string& scene_name, models::ray_compression compression) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		use_acceleration(*scene, core::acceleration_structure::bvh);
+
+		auto replies = get_intersect_replies(*scene);
+		std::vector<uint8_t> frame;
+		size_t bytes = 0;
+
+		for (auto _ : state) {
+			bytes = 0;
+
+			for (size_t begin = 0; begin < replies.size(); begin += wire_batch_size) {
+				size_t count = std::min(wire_batch_size, replies.size() - begin);
+				cloud::ray_wire::encode(models::message_type::intersect_result, 1,
+					std::span<const models::intersect_reply>(replies.data() + begin, count), compression, frame);
+
+				bytes += frame.size();
+				benchmark::DoNotOptimize(frame.data());
+			}
+		}
+
+		state.counters["bytes_per_ray"] = static_cast<double>(bytes) / replies.size();
+		set_mrays(state, replies.size());
+	}
+
+	// The same batches decoded from their receive buffers, as rank 0 reads them
+	static void wire_decode(benchmark::State& state, const std::string& scene_name, models::ray_compression compression) {
+		std::string error;
+		scene_data* scene = get_scene(scene_name, error);
+		if (!scene)
+			return state.SkipWithError(error.c_str());
+
+		use_acceleration(*scene, core::acceleration_structure::bvh);
+
+		auto replies = get_intersect_replies(*scene);
+		std::vector<std::vector<uint8_t>> frames;
+
+		for (size_t begin = 0; begin < replies.size(); begin += wire_batch_size) {
+			size_t count = std::min(wire_batch_size, replies.size() - begin);
+			cloud::ray_wire::encode(models::message_type::intersect_result, 1,
+				std::span<const models::intersect_reply>(replies.data() + begin, count), compression, frames.emplace_back());
+		}
+
+		std::vector<uint8_t> scratch;
+
+		for (auto _ : state) {
+			for (const auto& frame : frames) {
+				for (const auto& reply : cloud::ray_wire::decode<models::intersect_reply>(frame, scratch))
+					benchmark::DoNotOptimize(reply);
+			}
+		}
+
+		set_mrays(state, replies.size());
+	}
+}
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+
+	const std::pair<const char*, core::acceleration_structure> accelerations[] = {
+		{"kd_tree", core::acceleration_structure::kd_tree},
+		{"bvh", core::acceleration_structure::bvh}
+	};
+
+	for (std::string scene : {"cornell-box", "sponza-new"}) {
+		benchmark::RegisterBenchmark(("triangle_intersect/" + scene).c_str(), bench::triangle_intersect, scene);
+		benchmark::RegisterBenchmark(("triangle_packet_intersect/" + scene).c_str(), bench::triangle_packet_intersect, scene);
+		benchmark::RegisterBenchmark(("aabb_intersect/" + scene).c_str(), bench::aabb_intersect, scene);
+
+		for (const auto& [name, acceleration] : accelerations) {
+			benchmark::RegisterBenchmark(("mesh_intersect/" + scene + "/" + name).c_str(),
+			                             bench::mesh_intersect, scene, acceleration);
+			benchmark::RegisterBenchmark(("scene_intersect/" + scene + "/" + name).c_str(),
+			                             bench::scene_intersect, scene, acceleration);
+			benchmark::RegisterBenchmark(("scene_intersect_packet/" + scene + "/" + name).c_str(),
+			                             bench::scene_intersect_packet, scene, acceleration);
+		}
+	}
+
+	const std::pair<const char*, models::ray_compression> compressions[] = {
+		{"none", models::ray_compression::none},
+		{"lz4", models::ray_compression::lz4}
+	};
+
+	for (const auto& [name, compression] : compressions) {
+		benchmark::RegisterBenchmark(("wire_encode/cornell-box/" + std::string(name)).c_str(), bench::wire_encode, "cornell-box", compression);
+		benchmark::RegisterBenchmark(("wire_decode/cornell-box/" + std::string(name)).c_str(), bench::wire_decode, "cornell-box", compression);
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+}
@@ -0,0 +1,204 @@
+#include "path_tracer/core/bvh.hpp"
+
+#include "path_tracer/util/thread_pool.hpp"
+
+using namespace geometry;
+using namespace math;
+
+namespace core {
+	namespace bvh_builder {
+		static constexpr uint32_t bin_count = 16;
+
+		// Subtrees with fewer primitives are not worth a separate job
+		static constexpr uint32_t parallel_primitive_count = 4096;
+
+		struct bin {
+			aabb bounds;
+			uint32_t count = 0;
+		};
+
+		static uint32_t get_bin(const fvec3& centroid, const aabb& centroid_bounds, uint8_t axis) {
+			float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+			float offset = (centroid[axis] - centroid_bounds.min[axis]) / extent;
+			return std::min(static_cast<uint32_t>(offset * bin_count), bin_count - 1);
+		}
+
+		// Nodes are passed separately from the tree so that a subtree can be
+		// built into its own array, primitive indices are always shared
+		static uint32_t init_node(
+			std::vector<bvh_node>& nodes,
+			std::vector<uint32_t>& indices,
+			const std::vector<bvh::primitive>& primitives,
+			uint32_t begin, uint32_t end,
+			uint32_t max_leaf_size,
+			uint8_t depth) {
+			// Reserve the node slot so that
+			// the left child follows it directly
+			uint32_t node = nodes.size();
+			nodes.emplace_back();
+
+			// Seed from the first primitive because
+			// aabb::clear() is not suitable for negative bounds
+			aabb bounds = primitives[indices[begin]].bounds;
+			aabb centroid_bounds(primitives[indices[begin]].centroid,
+			                     primitives[indices[begin]].centroid);
+
+			for (uint32_t i = begin + 1; i < end; i++) {
+				const bvh::primitive& primitive = primitives[indices[i]];
+				bounds.add(primitive.bounds);
+				centroid_bounds.add(primitive.centroid);
+			}
+
+			uint32_t count = end - begin;
+
+			// Create leaf node once it's small enough
+			// or we've reached maximum depth
+			if (count <= max_leaf_size || depth == bvh::max_depth) {
+				nodes[node] = {bounds, begin, count};
+				return node;
+			}
+
+			float best_cost = std::numeric_limits<float>::max();
+			uint8_t best_axis = 0;
+			uint32_t best_split = 0;
+
+			for (uint8_t axis = 0; axis < 3; axis++) {
+				if (centroid_bounds.max[axis] <= centroid_bounds.min[axis])
+					continue;
+
+				std::array<bin, bin_count> bins;
+
+				for (uint32_t i = begin; i < end; i++) {
+					const bvh::primitive& primitive = primitives[indices[i]];
+					bin& bin = bins[get_bin(primitive.centroid, centroid_bounds, axis)];
+
+					if (bin.count++ == 0)
+						bin.bounds = primitive.bounds;
+					else
+						bin.bounds.add(primitive.bounds);
+				}
+
+				// Sweep from the right to gather
+				// the cost of every right partition
+				std::array<float, bin_count> right_costs;
+				aabb right_bounds;
+				uint32_t right_count = 0;
+
+				for (uint32_t i = bin_count - 1; i > 0; i--) {
+					if (bins[i].count > 0) {
+						if (right_count == 0)
+							right_bounds = bins[i].bounds;
+						else
+							right_bounds.add(bins[i].bounds);
+
+						right_count += bins[i].count;
+					}
+
+					right_costs[i] = right_count > 0
+						                 ? right_count * right_bounds.get_surface_area()
+						                 : 0;
+				}
+
+				// Then sweep from the left
+				// splitting after every bin
+				aabb left_bounds;
+				uint32_t left_count = 0;
+
+				for (uint32_t i = 0; i < bin_count - 1; i++) {
+					if (bins[i].count > 0) {
+						if (left_count == 0)
+							left_bounds = bins[i].bounds;
+						else
+							left_bounds.add(bins[i].bounds);
+
+						left_count += bins[i].count;
+					}
+
+					if (left_count == 0 || left_count == count)
+						continue;
+
+					float cost = left_count * left_bounds.get_surface_area()
+						+ right_costs[i + 1];
+
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_axis = axis;
+						best_split = i + 1;
+					}
+				}
+			}
+
+			// All centroids coincide or splitting costs
+			// more than testing every triangle
+			float leaf_cost = count * bounds.get_surface_area();
+
+			if (best_split == 0 || best_cost >= leaf_cost) {
+				nodes[node] = {bounds, begin, count};
+				return node;
+			}
+
+			auto middle = std::partition(
+				indices.begin() + begin,
+				indices.begin() + end,
+				[&](uint32_t index) {
+					return get_bin(primitives[index].centroid,
+					               centroid_bounds, best_axis) < best_split;
+				});
+
+			uint32_t split = middle - indices.begin();
+
+			// Partitions are disjoint, so a large right subtree can be built
+			// on the common pool and spliced in after the left one
+			std::vector<bvh_node> right_nodes;
+			std::shared_ptr<util::future> right_future;
+
+			if (end - split >= parallel_primitive_count) {
+				right_future = util::thread_pool::common_pool.submit([&, split, end, depth](uint32_t) {
+					init_node(right_nodes, indices, primitives, split, end, max_leaf_size, depth + 1);
+				});
+			}
+
+			try {
+				init_node(nodes, indices, primitives, begin, split, max_leaf_size, depth + 1);
+			}
+			catch (...) {
+				// The right job writes to right_nodes, which can't go away before it's done
+				if (right_future)
+					right_future->wait();
+				throw;
+			}
+
+			uint32_t right_child = nodes.size();
+
+			if (right_future) {
+				right_future->rethrow();
+
+				for (bvh_node right_node : right_nodes) {
+					if (!right_node.is_leaf())
+						right_node.offset += right_child;
+
+					nodes.push_back(right_node);
+				}
+			}
+			else
+				init_node(nodes, indices, primitives, split, end, max_leaf_size, depth + 1);
+
+			nodes[node] = {bounds, right_child, 0};
+			return node;
+		}
+	}
+
+	void bvh::build(const std::vector<primitive>& primitives, uint32_t max_leaf_size) {
+		nodes.clear();
+		indices.resize(primitives.size());
+		std::iota(indices.begin(), indices.end(), 0);
+
+		if (!primitives.empty()) {
+			bvh_builder::init_node(nodes, indices, primitives, 0, primitives.size(),
+			                       std::max(max_leaf_size, 1U), 0);
+		}
+
+		nodes.shrink_to_fit();
+		indices.shrink_to_fit();
+	}
+}
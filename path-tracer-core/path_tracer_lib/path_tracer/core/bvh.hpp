@@ -0,0 +1,81 @@
+#pragma once
+
+#include "path_tracer/pch.hpp"
+
+#include "path_tracer/geometry/aabb.hpp"
+#include "path_tracer/geometry/ray.hpp"
+
+namespace core {
+	// 32-byte node, two per cache line
+	//
+	// Nodes are stored depth-first, so a branch's left child
+	// always directly follows it in the node array
+	struct bvh_node {
+		geometry::aabb aabb;
+
+		// Right child index for branches,
+		// first entry in bvh::indices for leaves
+		uint32_t offset;
+
+		// Zero for branches
+		uint32_t index_count;
+
+		bool is_leaf() const {
+			return index_count > 0;
+		}
+	};
+
+	static_assert(sizeof(bvh_node) == 32);
+
+	// Used both per mesh over triangles and
+	// per scene over model instances
+	struct bvh {
+		struct primitive {
+			geometry::aabb bounds;
+			math::fvec3 centroid;
+		};
+
+		// Bounds the traversal stack, deeper nodes are turned into leaves
+		static constexpr uint8_t max_depth = 64;
+
+		// Packet traversal tracks active rays in a 64-bit mask
+		static constexpr uint32_t packet_width = 64;
+
+		std::vector<bvh_node> nodes;
+
+		// Leaves reference ranges of this array,
+		// which holds indices into the primitive array
+		std::vector<uint32_t> indices;
+
+		bool empty() const {
+			return nodes.empty();
+		}
+
+		// Binned SAH build, primitive indices are partitioned in place
+		void build(const std::vector<primitive>& primitives, uint32_t max_leaf_size = 4);
+
+		// Visits leaves front to back
+		//
+		// intersect(index) tests a single primitive and returns the distance
+		// to the nearest hit found so far, or a negative value if there's none
+		template <std::invocable<uint32_t> Intersect>
+		void traverse(const geometry::ray& ray, Intersect&& intersect) const;
+
+		// Visits leaves in no particular order and stops
+		// as soon as occluded(index) returns true
+		//
+		// Nodes further than max_dist along the ray are skipped
+		template <std::predicate<uint32_t> Occluded>
+		bool traverse_any(const geometry::ray& ray, float max_dist, Occluded&& occluded) const;
+
+		// Walks the tree once for up to packet_width rays, a node is entered
+		// if any ray that reached its parent hits its bounds
+		//
+		// Works best for coherent rays, intersect(ray_index, index) follows
+		// the same contract as in traverse for the given ray
+		template <std::invocable<uint32_t, uint32_t> Intersect>
+		void traverse_packet(std::span<const geometry::ray> rays, Intersect&& intersect) const;
+	};
+}
+
+#include "path_tracer/core/bvh.inl"
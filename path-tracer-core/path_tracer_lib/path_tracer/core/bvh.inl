@@ -0,0 +1,247 @@
+namespace core {
+	template <std::invocable<uint32_t> Intersect>
+	void bvh::traverse(const geometry::ray& ray, Intersect&& intersect) const {
+		if (empty())
+			return;
+
+		math::fvec3 inv_dir = math::fvec3::one / ray.get_dir();
+
+		auto root_hit = nodes[0].aabb.intersect(ray, inv_dir);
+		if (!root_hit.has_hit())
+			return;
+
+		struct todo {
+			uint32_t node;
+			float min_dist;
+		};
+
+		// At most one entry is pushed per tree level
+		std::array<todo, max_depth + 1> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, root_hit.near};
+
+		float nearest_dist = -1;
+
+		while (stack_size > 0) {
+			auto [node_index, min_dist] = stack[--stack_size];
+
+			// Skip nodes that lie behind the nearest hit so far
+			if (nearest_dist >= 0 && min_dist > nearest_dist)
+				continue;
+
+			const bvh_node* node = &nodes[node_index];
+
+			// Explore down the tree until we reach a leaf
+			while (!node->is_leaf()) {
+				uint32_t left = node_index + 1;
+				uint32_t right = node->offset;
+
+				auto left_hit = nodes[left].aabb.intersect(ray, inv_dir);
+				auto right_hit = nodes[right].aabb.intersect(ray, inv_dir);
+
+				bool visit_left = left_hit.has_hit() &&
+					(nearest_dist < 0 || left_hit.near <= nearest_dist);
+				bool visit_right = right_hit.has_hit() &&
+					(nearest_dist < 0 || right_hit.near <= nearest_dist);
+
+				if (visit_left && visit_right) {
+					// Visit the closer child first
+					if (right_hit.near < left_hit.near) {
+						stack[stack_size++] = {left, left_hit.near};
+						node_index = right;
+					}
+					else {
+						stack[stack_size++] = {right, right_hit.near};
+						node_index = left;
+					}
+				}
+				else if (visit_left)
+					node_index = left;
+				else if (visit_right)
+					node_index = right;
+				else
+					break;
+
+				node = &nodes[node_index];
+			}
+
+			if (!node->is_leaf())
+				continue;
+
+			// It's a leaf node
+			uint32_t end = node->offset + node->index_count;
+
+			for (uint32_t i = node->offset; i < end; i++)
+				nearest_dist = intersect(indices[i]);
+		}
+	}
+
+	template <std::predicate<uint32_t> Occluded>
+	bool bvh::traverse_any(const geometry::ray& ray, float max_dist, Occluded&& occluded) const {
+		if (empty())
+			return false;
+
+		math::fvec3 inv_dir = math::fvec3::one / ray.get_dir();
+
+		auto is_visited = [&](const geometry::aabb::intersection& hit) {
+			return hit.has_hit() && hit.near <= max_dist;
+		};
+
+		if (!is_visited(nodes[0].aabb.intersect(ray, inv_dir)))
+			return false;
+
+		// At most one entry is pushed per tree level
+		std::array<uint32_t, max_depth + 1> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0) {
+			uint32_t node_index = stack[--stack_size];
+			const bvh_node* node = &nodes[node_index];
+
+			// Explore down the tree until we reach a leaf
+			while (!node->is_leaf()) {
+				uint32_t left = node_index + 1;
+				uint32_t right = node->offset;
+
+				bool visit_left = is_visited(nodes[left].aabb.intersect(ray, inv_dir));
+				bool visit_right = is_visited(nodes[right].aabb.intersect(ray, inv_dir));
+
+				if (visit_left && visit_right) {
+					stack[stack_size++] = right;
+					node_index = left;
+				}
+				else if (visit_left)
+					node_index = left;
+				else if (visit_right)
+					node_index = right;
+				else
+					break;
+
+				node = &nodes[node_index];
+			}
+
+			if (!node->is_leaf())
+				continue;
+
+			// It's a leaf node
+			uint32_t end = node->offset + node->index_count;
+
+			for (uint32_t i = node->offset; i < end; i++) {
+				if (occluded(indices[i]))
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	template <std::invocable<uint32_t, uint32_t> Intersect>
+	void bvh::traverse_packet(std::span<const geometry::ray> rays, Intersect&& intersect) const {
+		if (empty() || rays.empty())
+			return;
+
+		if (rays.size() > packet_width)
+			throw std::out_of_range("Ray packet is wider than bvh::packet_width");
+
+		std::array<math::fvec3, packet_width> inv_dirs;
+		std::array<float, packet_width> nearest_dists;
+
+		for (size_t i = 0; i < rays.size(); i++) {
+			inv_dirs[i] = math::fvec3::one / rays[i].get_dir();
+			nearest_dists[i] = -1;
+		}
+
+		// Returns the rays in mask that hit the node in front of their nearest hit,
+		// along with the closest entry distance among them to order children by
+		auto intersect_node = [&](uint32_t node_index, uint64_t mask, float& min_dist) {
+			uint64_t hit_mask = 0;
+			min_dist = std::numeric_limits<float>::max();
+
+			for (; mask != 0; mask &= mask - 1) {
+				uint32_t i = std::countr_zero(mask);
+				auto hit = nodes[node_index].aabb.intersect(rays[i], inv_dirs[i]);
+
+				if (hit.has_hit() && (nearest_dists[i] < 0 || hit.near <= nearest_dists[i])) {
+					hit_mask |= uint64_t(1) << i;
+					min_dist = math::min(min_dist, hit.near);
+				}
+			}
+
+			return hit_mask;
+		};
+
+		struct todo {
+			uint32_t node;
+			uint64_t mask;
+		};
+
+		uint64_t all_rays = rays.size() == packet_width
+			? ~uint64_t(0)
+			: (uint64_t(1) << rays.size()) - 1;
+
+		float root_dist;
+		uint64_t root_mask = intersect_node(0, all_rays, root_dist);
+		if (root_mask == 0)
+			return;
+
+		// At most one entry is pushed per tree level
+		std::array<todo, max_depth + 1> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, root_mask};
+
+		while (stack_size > 0) {
+			auto [node_index, mask] = stack[--stack_size];
+			const bvh_node* node = &nodes[node_index];
+
+			// Explore down the tree until we reach a leaf
+			while (!node->is_leaf()) {
+				uint32_t left = node_index + 1;
+				uint32_t right = node->offset;
+
+				float left_dist, right_dist;
+				uint64_t left_mask = intersect_node(left, mask, left_dist);
+				uint64_t right_mask = intersect_node(right, mask, right_dist);
+
+				if (left_mask != 0 && right_mask != 0) {
+					// Visit the child closer to the packet first
+					if (right_dist < left_dist) {
+						stack[stack_size++] = {left, left_mask};
+						node_index = right;
+						mask = right_mask;
+					}
+					else {
+						stack[stack_size++] = {right, right_mask};
+						node_index = left;
+						mask = left_mask;
+					}
+				}
+				else if (left_mask != 0) {
+					node_index = left;
+					mask = left_mask;
+				}
+				else if (right_mask != 0) {
+					node_index = right;
+					mask = right_mask;
+				}
+				else
+					break;
+
+				node = &nodes[node_index];
+			}
+
+			if (!node->is_leaf())
+				continue;
+
+			// It's a leaf node
+			uint32_t end = node->offset + node->index_count;
+
+			for (uint32_t i = node->offset; i < end; i++) {
+				for (uint64_t active = mask; active != 0; active &= active - 1) {
+					uint32_t ray_index = std::countr_zero(active);
+					nearest_dists[ray_index] = intersect(ray_index, indices[i]);
+				}
+			}
+		}
+	}
+}
@@ -5,28 +5,87 @@
 #include "path_tracer/geometry/aabb.hpp"
 #include "path_tracer/geometry/ray.hpp"
 #include "path_tracer/geometry/triangle.hpp"
+#include "path_tracer/geometry/triangle_packet.hpp"
 
 namespace core {
+	// Packed 8-byte node
+	//
+	// The two lowest bits of flags hold the split axis,
+	// or leaf_flag for leaves, while the remaining bits hold
+	// either the right child index or the leaf's triangle count
+	//
+	// Nodes are stored depth-first, so a branch's left child
+	// always directly follows it in the node array
 	class kd_tree_node {
 	public:
-		virtual ~kd_tree_node() {
+		static constexpr uint32_t leaf_flag = 3;
+
+		static kd_tree_node make_branch(uint8_t axis, float split, uint32_t right_child) {
+			kd_tree_node node;
+			node.split = split;
+			node.flags = (right_child << 2) | axis;
+			return node;
 		}
 
-	protected:
-		kd_tree_node() {
+		static kd_tree_node make_leaf(uint32_t packet_offset, uint32_t triangle_count) {
+			kd_tree_node node;
+			node.packet_offset = packet_offset;
+			node.flags = (triangle_count << 2) | leaf_flag;
+			return node;
 		}
-	};
 
-	class kd_tree_branch : public kd_tree_node {
-	public:
-		uint8_t axis;
-		float split;
-		std::shared_ptr<kd_tree_node> left, right;
+		bool is_leaf() const {
+			return (flags & 3) == leaf_flag;
+		}
+
+		uint8_t get_axis() const {
+			return flags & 3;
+		}
+
+		float get_split() const {
+			return split;
+		}
+
+		uint32_t get_right_child() const {
+			return flags >> 2;
+		}
+
+		uint32_t get_packet_offset() const {
+			return packet_offset;
+		}
+
+		uint32_t get_triangle_count() const {
+			return flags >> 2;
+		}
+
+		uint32_t get_packet_count() const {
+			return (get_triangle_count() + geometry::triangle_packet::width - 1)
+				/ geometry::triangle_packet::width;
+		}
+
+	private:
+		union {
+			float split;
+			uint32_t packet_offset;
+		};
+
+		uint32_t flags;
 	};
 
-	class kd_tree_leaf : public kd_tree_node {
-	public:
-		std::vector<geometry::triangle> triangles;
-		std::vector<uint32_t> indices;
+	static_assert(sizeof(kd_tree_node) == 8);
+
+	struct kd_tree {
+		// Bounds the traversal stack, deeper builds are clamped
+		static constexpr uint8_t max_depth = 64;
+
+		std::vector<kd_tree_node> nodes;
+
+		// Leaves reference ranges of this array, each packet
+		// carries copies of up to eight triangles and their indices
+		std::vector<geometry::triangle_packet> packets;
+
+		bool empty() const {
+			return nodes.empty();
+		}
 	};
 }
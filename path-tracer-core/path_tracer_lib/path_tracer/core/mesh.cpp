@@ -1,19 +1,29 @@
 #include "path_tracer/core/mesh.hpp"
 
 #include "path_tracer/geometry/triangle.hpp"
+#include "path_tracer/geometry/triangle_packet.hpp"
+#include "path_tracer/util/thread_pool.hpp"
 
 using namespace geometry;
 using namespace math;
 
 namespace core {
 	namespace kd_tree_builder {
-		static kd_tree_node* init_leaf(
-			std::vector<triangle>&& triangles,
-			std::vector<uint32_t>&& indices) {
-			auto node = new kd_tree_leaf;
+		static uint32_t init_leaf(
+			kd_tree& tree,
+			const std::vector<triangle>& triangles,
+			const std::vector<uint32_t>& indices) {
+			uint32_t node = tree.nodes.size();
+
+			tree.nodes.push_back(kd_tree_node::make_leaf(
+				tree.packets.size(), triangles.size()));
+
+			for (size_t i = 0; i < triangles.size(); i++) {
+				if (i % triangle_packet::width == 0)
+					tree.packets.emplace_back();
 
-			(node->triangles = std::move(triangles)).shrink_to_fit();
-			(node->indices = std::move(indices)).shrink_to_fit();
+				tree.packets.back().add(triangles[i], indices[i]);
+			}
 
 			return node;
 		}
@@ -79,88 +89,165 @@ namespace core {
 			};
 		}
 
-		static kd_tree_node* init_node_median(
+		static uint32_t init_node_median(
+			kd_tree& tree,
 			aabb&& aabb,
 			std::vector<triangle>&& triangles,
 			std::vector<uint32_t>&& indices,
 			uint8_t depth) {
 			// Create leaf node once
 			// we've reached maximum depth
-			if (depth == 0) {
-				return init_leaf(std::move(triangles),
-				                 std::move(indices));
-			}
+			if (depth == 0)
+				return init_leaf(tree, triangles, indices);
 
-			auto node = new kd_tree_branch;
+			// Reserve the branch slot so that
+			// the left child follows it directly
+			uint32_t node = tree.nodes.size();
+			tree.nodes.emplace_back();
 
 			// We split in the middle
 			fvec3 widths = aabb.max - aabb.min;
-			node->axis = std::max_element(&widths.x,
-			                              &widths.x + 3) - &widths.x;
-			node->split = aabb.min[node->axis] +
-				widths[node->axis] * 0.5F;
+			uint8_t axis = std::max_element(&widths.x,
+			                                &widths.x + 3) - &widths.x;
+			float split = aabb.min[axis] + widths[axis] * 0.5F;
 
-			auto [laabb, raabb] = split_aabb(aabb,
-			                                 node->axis, node->split);
+			auto [laabb, raabb] = split_aabb(aabb, axis, split);
 
 			auto [ltriangles, rtriangles,
 					lindices, rindices] =
-				split_triangles(triangles,
-				                indices, node->axis, node->split);
+				split_triangles(triangles, indices, axis, split);
 
+			// Empty children become empty leaves
 			if (ltriangles.size() > 0) {
-				node->left.reset(init_node_median(
+				init_node_median(
+					tree,
 					std::move(laabb),
 					std::move(ltriangles),
 					std::move(lindices),
-					depth - 1));
+					depth - 1);
 			}
+			else
+				init_leaf(tree, {}, {});
+
+			uint32_t right_child = tree.nodes.size();
 
 			if (rtriangles.size() > 0) {
-				node->right.reset(init_node_median(
+				init_node_median(
+					tree,
 					std::move(raabb),
 					std::move(rtriangles),
 					std::move(rindices),
-					depth - 1));
+					depth - 1);
 			}
+			else
+				init_leaf(tree, {}, {});
 
+			tree.nodes[node] = kd_tree_node::make_branch(axis, split, right_child);
 			return node;
 		}
 
+		// Appends a subtree that was built on its own,
+		// relocating its child and packet offsets
+		static void append_subtree(kd_tree& tree, const kd_tree& subtree) {
+			uint32_t node_offset = tree.nodes.size();
+			uint32_t packet_offset = tree.packets.size();
+
+			for (const kd_tree_node& node : subtree.nodes) {
+				if (node.is_leaf()) {
+					tree.nodes.push_back(kd_tree_node::make_leaf(
+						node.get_packet_offset() + packet_offset,
+						node.get_triangle_count()));
+				}
+				else {
+					tree.nodes.push_back(kd_tree_node::make_branch(
+						node.get_axis(), node.get_split(),
+						node.get_right_child() + node_offset));
+				}
+			}
+
+			tree.packets.insert(tree.packets.end(),
+			                    subtree.packets.begin(), subtree.packets.end());
+		}
+
+		// Triangle bounds along one axis, sorted once for the whole tree
+		// and then split in order, so no node has to sort again
+		struct event {
+			float position;
+			uint32_t triangle; // Index into the node's triangle list
+			bool start;
+		};
+
+		using events = std::array<std::vector<event>, 3>;
+
+		// Subtrees with fewer triangles are not worth a separate job
+		static constexpr size_t parallel_triangle_count = 2048;
+
+		static events init_events(const std::vector<triangle>& triangles) {
+			events events;
+
+			for (uint8_t axis = 0; axis < 3; axis++) {
+				events[axis].reserve(triangles.size() * 2);
+
+				for (uint32_t i = 0; i < triangles.size(); i++) {
+					const triangle& triangle = triangles[i];
+					float start = math::min(triangle.a[axis], triangle.b[axis], triangle.c[axis]);
+					float end = math::max(triangle.a[axis], triangle.b[axis], triangle.c[axis]);
+
+					events[axis].push_back({start, i, true});
+					events[axis].push_back({end, i, false});
+				}
+
+				std::sort(events[axis].begin(), events[axis].end(),
+				          [](auto& x, auto& y) { return x.position < y.position; });
+			}
+
+			return events;
+		}
+
+		// Keeps the order of events, so both children stay sorted
+		static std::tuple<events, events> split_events(
+			const events& events,
+			const std::vector<uint32_t>& lremap,
+			const std::vector<uint32_t>& rremap,
+			size_t lcount, size_t rcount) {
+			kd_tree_builder::events levents, revents;
+
+			for (uint8_t axis = 0; axis < 3; axis++) {
+				levents[axis].reserve(lcount * 2);
+				revents[axis].reserve(rcount * 2);
+
+				for (const event& event : events[axis]) {
+					if (lremap[event.triangle] != static_cast<uint32_t>(-1))
+						levents[axis].push_back({event.position, lremap[event.triangle], event.start});
+
+					if (rremap[event.triangle] != static_cast<uint32_t>(-1))
+						revents[axis].push_back({event.position, rremap[event.triangle], event.start});
+				}
+			}
+
+			return {levents, revents};
+		}
+
 		// Alternative to init_node_median
-		kd_tree_node* init_node_sah(
+		uint32_t init_node_sah(
+			kd_tree& tree,
 			aabb&& aabb,
 			std::vector<triangle>&& triangles,
 			std::vector<uint32_t>&& indices,
+			events&& events,
 			uint8_t depth) {
 			// Create leaf node once
 			// we've reached maximum depth
 			if (depth == 0)
-				return init_leaf(std::move(triangles), std::move(indices));
-
-			fvec3 widths = aabb.max - aabb.min;
+				return init_leaf(tree, triangles, indices);
 
 			float base_cost = triangles.size() * aabb.get_surface_area();
 			float best_cost = base_cost;
 			uint8_t best_axis;
 			float best_split;
 
-			std::vector<std::tuple<float, bool>> bounds;
-			bounds.reserve(triangles.size() * 2);
-
 			for (uint8_t axis = 0; axis < 3; axis++) {
-				bounds.clear();
-
-				for (triangle& triangle : triangles) {
-					float start = math::min(triangle.a[axis], triangle.b[axis], triangle.c[axis]);
-					float end = math::max(triangle.a[axis], triangle.b[axis], triangle.c[axis]);
-
-					bounds.emplace_back(start, true);
-					bounds.emplace_back(end, false);
-				}
-
-				std::sort(bounds.begin(), bounds.end(),
-				          [](auto& x, auto& y) { return get<0>(x) < get<0>(y); });
+				const std::vector<event>& bounds = events[axis];
 
 				float split;
 				uint32_t lcount = 0;
@@ -168,25 +255,25 @@ namespace core {
 
 				for (size_t i = 0; i <= bounds.size(); i++) {
 					if (i == 0)
-						split = get<0>(bounds.front()) - math::epsilon;
+						split = bounds.front().position - math::epsilon;
 					else if (i == bounds.size()) {
 						// Last event is always END
 						rcount--;
-						split = get<0>(bounds.back()) + math::epsilon;
+						split = bounds.back().position + math::epsilon;
 					}
 					else {
-						auto& prev_bound = bounds[i - 1];
-						auto& next_bound = bounds[i];
+						const event& prev_bound = bounds[i - 1];
+						const event& next_bound = bounds[i];
 
-						if (get<1>(prev_bound))
+						if (prev_bound.start)
 							lcount++;
 						else
 							rcount--;
 
-						if (get<0>(prev_bound) == get<0>(next_bound))
+						if (prev_bound.position == next_bound.position)
 							continue;
 
-						split = (get<0>(prev_bound) + get<0>(next_bound)) * 0.5F;
+						split = (prev_bound.position + next_bound.position) * 0.5F;
 					}
 
 					// Accumulate events until we enter the AABB
@@ -210,40 +297,122 @@ namespace core {
 				}
 			}
 
-			if (best_cost < base_cost) {
-				auto node = new kd_tree_branch;
+			if (best_cost >= base_cost)
+				return init_leaf(tree, triangles, indices);
 
-				node->axis = best_axis;
-				node->split = best_split;
+			// Reserve the branch slot so that
+			// the left child follows it directly
+			uint32_t node = tree.nodes.size();
+			tree.nodes.emplace_back();
 
-				auto [laabb, raabb] = split_aabb(aabb,
-				                                 node->axis, node->split);
+			auto [laabb, raabb] = split_aabb(aabb,
+			                                 best_axis, best_split);
 
-				auto [ltriangles, rtriangles,
-						lindices, rindices] =
-					split_triangles(triangles, indices,
-					                node->axis, node->split);
+			// Same assignment as split_triangles, but also remembers
+			// where each triangle went so that events can follow it
+			std::vector<triangle> ltriangles, rtriangles;
+			std::vector<uint32_t> lindices, rindices;
+			std::vector<uint32_t> lremap(triangles.size(), -1), rremap(triangles.size(), -1);
 
+			ltriangles.reserve(triangles.size());
+			rtriangles.reserve(triangles.size());
+			lindices.reserve(indices.size());
+			rindices.reserve(indices.size());
+
+			for (size_t i = 0; i < triangles.size(); i++) {
+				const triangle& triangle = triangles[i];
+
+				bool lassign = false, rassign = false;
+
+				for (size_t j = 0; j < 3; j++) {
+					if (triangle[j][best_axis] < best_split)
+						lassign = true;
+					else
+						rassign = true;
+				}
+
+				if (lassign) {
+					lremap[i] = ltriangles.size();
+					ltriangles.push_back(triangle);
+					lindices.push_back(indices[i]);
+				}
+
+				if (rassign) {
+					rremap[i] = rtriangles.size();
+					rtriangles.push_back(triangle);
+					rindices.push_back(indices[i]);
+				}
+			}
+
+			auto [levents, revents] = split_events(events, lremap, rremap,
+			                                       ltriangles.size(), rtriangles.size());
+
+			// Free the parent's lists before descending
+			std::vector<triangle>().swap(triangles);
+			std::vector<uint32_t>().swap(indices);
+			kd_tree_builder::events().swap(events);
+
+			// Build a large right subtree on the common pool while
+			// this thread builds the left one, then splice it in
+			// so that the depth-first layout matches a serial build
+			kd_tree rtree;
+			std::shared_ptr<util::future> rfuture;
+
+			if (rtriangles.size() >= parallel_triangle_count) {
+				rfuture = util::thread_pool::common_pool.submit(
+					[&rtree, raabb = raabb, rtriangles = std::move(rtriangles), rindices = std::move(rindices),
+						revents = std::move(revents), depth](uint32_t) mutable {
+						init_node_sah(
+							rtree,
+							std::move(raabb),
+							std::move(rtriangles),
+							std::move(rindices),
+							std::move(revents),
+							depth - 1);
+					});
+			}
+
+			// Empty children become empty leaves
+			try {
 				if (ltriangles.size() > 0) {
-					node->left.reset(kd_tree_builder::init_node_sah(
+					init_node_sah(
+						tree,
 						std::move(laabb),
 						std::move(ltriangles),
 						std::move(lindices),
-						depth - 1));
+						std::move(levents),
+						depth - 1);
 				}
+				else
+					init_leaf(tree, {}, {});
+			}
+			catch (...) {
+				// The right job writes to rtree, which can't go away before it's done
+				if (rfuture)
+					rfuture->wait();
+				throw;
+			}
 
-				if (rtriangles.size() > 0) {
-					node->right.reset(kd_tree_builder::init_node_sah(
-						std::move(raabb),
-						std::move(rtriangles),
-						std::move(rindices),
-						depth - 1));
-				}
+			uint32_t right_child = tree.nodes.size();
 
-				return node;
+			if (rfuture) {
+				rfuture->rethrow();
+				append_subtree(tree, rtree);
+			}
+			else if (rtriangles.size() > 0) {
+				init_node_sah(
+					tree,
+					std::move(raabb),
+					std::move(rtriangles),
+					std::move(rindices),
+					std::move(revents),
+					depth - 1);
 			}
 			else
-				return init_leaf(std::move(triangles), std::move(indices));
+				init_leaf(tree, {}, {});
+
+			tree.nodes[node] = kd_tree_node::make_branch(best_axis, best_split, right_child);
+			return node;
 		}
 	}
 
@@ -280,41 +449,100 @@ namespace core {
 
 		std::cout << "Building kD tree..." << std::endl;
 
+		kd_tree.nodes.clear();
+		kd_tree.packets.clear();
+
+		max_depth = std::min(max_depth, core::kd_tree::max_depth);
+
 		// Start executing initial job
 		if (use_sah) {
-			kd_tree.reset(kd_tree_builder::init_node_sah(
-				std::move(aabb),
+			auto events = kd_tree_builder::init_events(triangles);
+
+			kd_tree_builder::init_node_sah(
+				kd_tree,
+				geometry::aabb(aabb),
 				std::move(triangles),
 				std::move(indices),
-				max_depth));
+				std::move(events),
+				max_depth);
 		}
 		else {
-			kd_tree.reset(kd_tree_builder::init_node_median(
-				std::move(aabb),
+			kd_tree_builder::init_node_median(
+				kd_tree,
+				geometry::aabb(aabb),
 				std::move(triangles),
 				std::move(indices),
-				max_depth));
+				max_depth);
 		}
+
+		kd_tree.nodes.shrink_to_fit();
+		kd_tree.packets.shrink_to_fit();
+
+		bvh = {};
+		acceleration = acceleration_structure::kd_tree;
+	}
+
+	void mesh::build_bvh(uint32_t max_leaf_size) {
+		bvh = {};
+		kd_tree = {};
+		acceleration = acceleration_structure::bvh;
+
+		std::vector<core::bvh::primitive> primitives;
+		primitives.reserve(triangles.size());
+
+		for (const uvec3& indices : triangles) {
+			const fvec3& a = vertices[indices.x].position;
+			const fvec3& b = vertices[indices.y].position;
+			const fvec3& c = vertices[indices.z].position;
+
+			geometry::aabb bounds(math::min(a, math::min(b, c)),
+			                      math::max(a, math::max(b, c)));
+
+			primitives.push_back({bounds, (a + b + c) / 3.0F});
+		}
+
+		std::cout << "Building BVH..." << std::endl;
+
+		// Triangle indices are partitioned in place,
+		// so unlike the kD tree nothing is duplicated
+		bvh.build(primitives, max_leaf_size);
 	}
 
 	mesh::intersection mesh::intersect(const ray& ray, uint8_t visualize_kd_tree_depth) const {
+		if (acceleration == acceleration_structure::bvh)
+			return intersect_bvh(ray);
+		else
+			return intersect_kd_tree(ray, visualize_kd_tree_depth);
+	}
+
+	mesh::intersection mesh::intersect_kd_tree(const ray& ray, uint8_t visualize_kd_tree_depth) const {
+		if (kd_tree.empty())
+			return {};
+
 		auto result = aabb.intersect(ray);
 		if (!result.has_hit())
 			return {};
 
-		// uint8_t depth is only used for tree visualization 
-		std::stack<std::tuple<const kd_tree_node*, float, float, uint8_t>> stack;
-		stack.push(std::make_tuple(kd_tree.get(), result.near, result.far, 1));
+		// uint8_t depth is only used for tree visualization
+		struct todo {
+			uint32_t node;
+			float min_dist, max_dist;
+			uint8_t depth;
+		};
 
-		while (!stack.empty()) {
-			auto [node, min_dist, max_dist, depth] = stack.top();
-			stack.pop();
+		// At most one entry is pushed per tree level
+		std::array<todo, core::kd_tree::max_depth> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, result.near, result.far, 1};
+
+		while (stack_size > 0) {
+			auto [node_index, min_dist, max_dist, depth] = stack[--stack_size];
+			const kd_tree_node* node = &kd_tree.nodes[node_index];
 
 			// Explore down the tree until we reach a leaf
-			while (node && typeid(*node) == typeid(kd_tree_branch)) {
+			while (!node->is_leaf()) {
 				if (depth++ == visualize_kd_tree_depth) {
-					size_t ptr_val = reinterpret_cast<size_t>(node);
-					std::mt19937 rng{static_cast<unsigned int>(ptr_val)};
+					std::mt19937 rng{node_index};
 					float hue = std::uniform_real_distribution<float>{0, 1}(rng);
 
 					fvec3 color = math::saturate(fvec3(
@@ -330,21 +558,22 @@ namespace core {
 					};
 				}
 
-				auto branch = static_cast<const kd_tree_branch*>(node);
+				uint8_t axis = node->get_axis();
+				float split = node->get_split();
 
 				// Distance to the split plane
-				float split_dist = (branch->split - ray.origin[branch
-					->axis]) / ray.get_dir()[branch->axis];
+				float split_dist = (split - ray.origin[axis]) / ray.get_dir()[axis];
 
-				const kd_tree_node *first, *second;
+				// Left child directly follows its parent
+				uint32_t first, second;
 
-				if (ray.origin[branch->axis] < branch->split) {
-					first = branch->left.get();
-					second = branch->right.get();
+				if (ray.origin[axis] < split) {
+					first = node_index + 1;
+					second = node->get_right_child();
 				}
 				else {
-					first = branch->right.get();
-					second = branch->left.get();
+					first = node->get_right_child();
+					second = node_index + 1;
 				}
 
 				// If ray points away from the split plane
@@ -352,39 +581,38 @@ namespace core {
 				// than distance to the split plane,
 				// we've hit just the first node
 				if (split_dist < 0 || split_dist > max_dist)
-					node = first;
+					node_index = first;
 
 					// When node's AABB is further away than the split plane
 					// then we've hit second node only
 				else if (split_dist < min_dist)
-					node = second;
+					node_index = second;
 
 				// Otherwise we've hit them both
 				else {
-					if (second)
-						stack.push(std::make_tuple(second, split_dist, max_dist, depth));
+					stack[stack_size++] = {second, split_dist, max_dist, depth};
 
-					node = first;
+					node_index = first;
 					max_dist = split_dist;
 				}
-			}
 
-			if (!node)
-				continue;
+				node = &kd_tree.nodes[node_index];
+			}
 
 			// It's a leaf node
-			auto leaf = static_cast<const kd_tree_leaf*>(node);
+			uint32_t begin = node->get_packet_offset();
+			uint32_t end = begin + node->get_packet_count();
 
-			triangle::intersection nearest_hit;
+			triangle_packet::intersection nearest_hit;
 			uint32_t index = 0;
 
-			for (uint32_t i = 0; i < leaf->triangles.size(); i++) {
-				auto hit = leaf->triangles[i].intersect(ray);
-				if (hit.has_hit() && hit.distance <= max_dist &&
+			for (uint32_t i = begin; i < end; i++) {
+				auto hit = kd_tree.packets[i].intersect(ray, max_dist);
+				if (hit.has_hit() &&
 					(hit.distance < nearest_hit.distance ||
 						!nearest_hit.has_hit())) {
 					nearest_hit = hit;
-					index = i;
+					index = kd_tree.packets[i].indices[hit.lane];
 				}
 			}
 
@@ -397,10 +625,133 @@ namespace core {
 			return {
 				nearest_hit.distance,
 				nearest_hit.barycentric,
-				leaf->indices[index]
+				index
 			};
 		}
 
 		return {};
 	}
+
+	mesh::intersection mesh::intersect_bvh(const ray& ray) const {
+		triangle::intersection nearest_hit;
+		uint32_t index = 0;
+
+		bvh.traverse(ray, [&](uint32_t i) {
+			const uvec3& vertex_indices = triangles[i];
+			triangle triangle(
+				vertices[vertex_indices.x].position,
+				vertices[vertex_indices.y].position,
+				vertices[vertex_indices.z].position
+			);
+
+			auto hit = triangle.intersect(ray);
+			if (hit.has_hit() &&
+				(hit.distance < nearest_hit.distance ||
+					!nearest_hit.has_hit())) {
+				nearest_hit = hit;
+				index = i;
+			}
+
+			return nearest_hit.distance;
+		});
+
+		if (!nearest_hit.has_hit())
+			return {};
+
+		return {
+			nearest_hit.distance,
+			nearest_hit.barycentric,
+			index
+		};
+	}
+
+	bool mesh::occluded(const ray& ray, float max_dist) const {
+		if (acceleration == acceleration_structure::bvh)
+			return occluded_bvh(ray, max_dist);
+		else
+			return occluded_kd_tree(ray, max_dist);
+	}
+
+	bool mesh::occluded_kd_tree(const ray& ray, float max_dist) const {
+		if (kd_tree.empty())
+			return false;
+
+		auto result = aabb.intersect(ray);
+		if (!result.has_hit() || result.near > max_dist)
+			return false;
+
+		struct todo {
+			uint32_t node;
+			float min_dist, max_dist;
+		};
+
+		// At most one entry is pushed per tree level
+		std::array<todo, core::kd_tree::max_depth> stack;
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, result.near, math::min(result.far, max_dist)};
+
+		while (stack_size > 0) {
+			auto [node_index, min_dist, node_max_dist] = stack[--stack_size];
+			const kd_tree_node* node = &kd_tree.nodes[node_index];
+
+			// Same descent as intersect_kd_tree, but the far end
+			// of each node is clipped to max_dist up front
+			while (!node->is_leaf()) {
+				uint8_t axis = node->get_axis();
+				float split = node->get_split();
+
+				float split_dist = (split - ray.origin[axis]) / ray.get_dir()[axis];
+
+				uint32_t first, second;
+
+				if (ray.origin[axis] < split) {
+					first = node_index + 1;
+					second = node->get_right_child();
+				}
+				else {
+					first = node->get_right_child();
+					second = node_index + 1;
+				}
+
+				if (split_dist < 0 || split_dist > node_max_dist)
+					node_index = first;
+				else if (split_dist < min_dist)
+					node_index = second;
+				else {
+					stack[stack_size++] = {second, split_dist, node_max_dist};
+
+					node_index = first;
+					node_max_dist = split_dist;
+				}
+
+				node = &kd_tree.nodes[node_index];
+			}
+
+			// It's a leaf node, any hit in front of max_dist will do,
+			// even one outside of the leaf's own extent
+			uint32_t begin = node->get_packet_offset();
+			uint32_t end = begin + node->get_packet_count();
+
+			for (uint32_t i = begin; i < end; i++) {
+				if (kd_tree.packets[i].intersect(ray, max_dist).has_hit())
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool mesh::occluded_bvh(const ray& ray, float max_dist) const {
+		return bvh.traverse_any(ray, max_dist, [&](uint32_t i) {
+			const uvec3& vertex_indices = triangles[i];
+			triangle triangle(
+				vertices[vertex_indices.x].position,
+				vertices[vertex_indices.y].position,
+				vertices[vertex_indices.z].position
+			);
+
+			auto hit = triangle.intersect(ray);
+			return hit.has_hit() && hit.distance <= max_dist;
+		});
+	}
 }
@@ -2,6 +2,7 @@
 
 #include "path_tracer/pch.hpp"
 
+#include "path_tracer/core/bvh.hpp"
 #include "path_tracer/core/kd_tree.hpp"
 #include "path_tracer/core/material.hpp"
 #include "path_tracer/core/vertex.hpp"
@@ -10,6 +11,11 @@
 #include "path_tracer/math/vec3.hpp"
 
 namespace core {
+	enum class acceleration_structure {
+		kd_tree,
+		bvh
+	};
+
 	struct mesh {
 		struct intersection {
 			float distance = -1;
@@ -22,7 +28,9 @@ namespace core {
 		std::vector<vertex> vertices;
 		std::vector<math::uvec3> triangles;
 		geometry::aabb aabb;
-		std::shared_ptr<kd_tree_node> kd_tree = nullptr;
+		core::kd_tree kd_tree;
+		core::bvh bvh;
+		acceleration_structure acceleration = acceleration_structure::kd_tree;
 		std::shared_ptr<core::material> material = nullptr;
 
 		// void recalculate_normals(bool shade_smooth = false);
@@ -33,6 +41,22 @@ namespace core {
 
 		void build_kd_tree(bool use_sah = true, uint8_t max_depth = 25);
 
+		void build_bvh(uint32_t max_leaf_size = 4);
+
+		// Uses whichever structure was built last
 		intersection intersect(const geometry::ray& ray, uint8_t visualize_kd_tree_depth = 0) const;
+
+		// Any-hit query for shadow rays, stops at the first
+		// triangle hit no further than max_dist
+		bool occluded(const geometry::ray& ray, float max_dist = std::numeric_limits<float>::max()) const;
+
+	private:
+		intersection intersect_kd_tree(const geometry::ray& ray, uint8_t visualize_kd_tree_depth) const;
+
+		intersection intersect_bvh(const geometry::ray& ray) const;
+
+		bool occluded_kd_tree(const geometry::ray& ray, float max_dist) const;
+
+		bool occluded_bvh(const geometry::ray& ray, float max_dist) const;
 	};
 }
@@ -39,10 +39,13 @@ namespace geometry {
 	}
 
 	aabb::intersection aabb::intersect(const ray& ray) const {
+		return intersect(ray, fvec3::one / ray.get_dir());
+	}
+
+	aabb::intersection aabb::intersect(const ray& ray, const fvec3& inv_dir) const {
 		if (any(min > max))
 			return {};
 
-		fvec3 inv_dir = fvec3::one / ray.get_dir();
 		fvec3 min_bounds_distances = (min - ray.origin) * inv_dir;
 		fvec3 max_bounds_distances = (max - ray.origin) * inv_dir;
 
@@ -26,5 +26,8 @@ namespace geometry {
 		float get_surface_area() const;
 
 		intersection intersect(const ray& ray) const;
+
+		// Reuses the reciprocal direction across many boxes
+		intersection intersect(const ray& ray, const math::fvec3& inv_dir) const;
 	};
 }
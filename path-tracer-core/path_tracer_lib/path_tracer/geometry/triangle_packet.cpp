@@ -0,0 +1,304 @@
+#include "path_tracer/geometry/triangle_packet.hpp"
+
+#include "path_tracer/math/math.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATH_TRACER_TRIANGLE_PACKET_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace math;
+
+namespace geometry {
+	bool triangle_packet::intersection::has_hit() const {
+		return distance >= 0;
+	}
+
+	void triangle_packet::add(const triangle& triangle, uint32_t index) {
+		if (count == width)
+			throw std::out_of_range("Triangle packet is full.");
+
+		ax[count] = triangle.a.x;
+		ay[count] = triangle.a.y;
+		az[count] = triangle.a.z;
+		bx[count] = triangle.b.x;
+		by[count] = triangle.b.y;
+		bz[count] = triangle.b.z;
+		cx[count] = triangle.c.x;
+		cy[count] = triangle.c.y;
+		cz[count] = triangle.c.z;
+		indices[count] = index;
+		count++;
+	}
+
+	namespace triangle_packet_kernels {
+		using kernel = triangle_packet::intersection (*)(
+			const triangle_packet& packet, const ray& ray, float max_dist);
+
+		// Picks the nearest of the lanes flagged in hit_mask,
+		// scanning in lane order so that ties resolve the same way
+		static triangle_packet::intersection reduce(
+			uint32_t hit_mask,
+			const float* dist, const float* alpha,
+			const float* beta, const float* gamma) {
+			triangle_packet::intersection nearest_hit;
+
+			for (uint32_t lane = 0; hit_mask != 0; lane++, hit_mask >>= 1) {
+				if (!(hit_mask & 1))
+					continue;
+
+				if (!nearest_hit.has_hit() || dist[lane] < nearest_hit.distance) {
+					nearest_hit.distance = dist[lane];
+					nearest_hit.barycentric = fvec3(alpha[lane], beta[lane], gamma[lane]);
+					nearest_hit.lane = lane;
+				}
+			}
+
+			return nearest_hit;
+		}
+
+		static triangle_packet::intersection intersect_scalar(
+			const triangle_packet& packet, const ray& ray, float max_dist) {
+			triangle_packet::intersection nearest_hit;
+
+			for (uint32_t lane = 0; lane < packet.count; lane++) {
+				fvec3 a(packet.ax[lane], packet.ay[lane], packet.az[lane]);
+				fvec3 b(packet.bx[lane], packet.by[lane], packet.bz[lane]);
+				fvec3 c(packet.cx[lane], packet.cy[lane], packet.cz[lane]);
+
+				auto hit = triangle(a, b, c).intersect(ray);
+				if (hit.has_hit() && hit.distance <= max_dist &&
+					(hit.distance < nearest_hit.distance ||
+						!nearest_hit.has_hit())) {
+					nearest_hit.distance = hit.distance;
+					nearest_hit.barycentric = hit.barycentric;
+					nearest_hit.lane = lane;
+				}
+			}
+
+			return nearest_hit;
+		}
+
+#ifdef PATH_TRACER_TRIANGLE_PACKET_SIMD
+		// Both vector kernels mirror triangle::intersect operation by operation
+		// and never contract into FMA, which keeps them bit-identical to it
+
+		static triangle_packet::intersection intersect_sse(
+			const triangle_packet& packet, const ray& ray, float max_dist) {
+			fvec3 dir = ray.get_dir();
+
+			__m128 dx = _mm_set1_ps(dir.x);
+			__m128 dy = _mm_set1_ps(dir.y);
+			__m128 dz = _mm_set1_ps(dir.z);
+			__m128 ox = _mm_set1_ps(ray.origin.x);
+			__m128 oy = _mm_set1_ps(ray.origin.y);
+			__m128 oz = _mm_set1_ps(ray.origin.z);
+
+			__m128 one = _mm_set1_ps(1);
+			__m128 zero = _mm_setzero_ps();
+			__m128 lower = _mm_set1_ps(0 - epsilon);
+			__m128 upper = _mm_set1_ps(1 + epsilon);
+			__m128 max = _mm_set1_ps(max_dist);
+
+			alignas(16) std::array<float, triangle_packet::width> dist, alpha, beta, gamma;
+			uint32_t hit_mask = 0;
+
+			for (uint32_t offset = 0; offset < packet.count; offset += 4) {
+				__m128 ax = _mm_load_ps(packet.ax.data() + offset);
+				__m128 ay = _mm_load_ps(packet.ay.data() + offset);
+				__m128 az = _mm_load_ps(packet.az.data() + offset);
+
+				// m = [a - b, a - c, dir]
+				__m128 m0x = _mm_sub_ps(ax, _mm_load_ps(packet.bx.data() + offset));
+				__m128 m0y = _mm_sub_ps(ay, _mm_load_ps(packet.by.data() + offset));
+				__m128 m0z = _mm_sub_ps(az, _mm_load_ps(packet.bz.data() + offset));
+				__m128 m1x = _mm_sub_ps(ax, _mm_load_ps(packet.cx.data() + offset));
+				__m128 m1y = _mm_sub_ps(ay, _mm_load_ps(packet.cy.data() + offset));
+				__m128 m1z = _mm_sub_ps(az, _mm_load_ps(packet.cz.data() + offset));
+
+				__m128 vx = _mm_sub_ps(ax, ox);
+				__m128 vy = _mm_sub_ps(ay, oy);
+				__m128 vz = _mm_sub_ps(az, oz);
+
+				__m128 c1 = _mm_sub_ps(_mm_mul_ps(m1y, dz), _mm_mul_ps(dy, m1z));
+				__m128 c2 = _mm_sub_ps(_mm_mul_ps(m0y, dz), _mm_mul_ps(dy, m0z));
+				__m128 c3 = _mm_sub_ps(_mm_mul_ps(m0y, m1z), _mm_mul_ps(m1y, m0z));
+				__m128 c4 = _mm_sub_ps(_mm_mul_ps(vy, dz), _mm_mul_ps(dy, vz));
+				__m128 c5 = _mm_sub_ps(_mm_mul_ps(m0y, vz), _mm_mul_ps(vy, m0z));
+				__m128 c6 = _mm_sub_ps(_mm_mul_ps(m1y, vz), _mm_mul_ps(vy, m1z));
+
+				__m128 inv_det = _mm_div_ps(one, _mm_add_ps(
+					_mm_sub_ps(_mm_mul_ps(m0x, c1), _mm_mul_ps(m1x, c2)),
+					_mm_mul_ps(dx, c3)));
+
+				__m128 b = _mm_mul_ps(inv_det, _mm_sub_ps(
+					_mm_sub_ps(_mm_mul_ps(vx, c1), _mm_mul_ps(m1x, c4)),
+					_mm_mul_ps(dx, c6)));
+
+				__m128 g = _mm_mul_ps(inv_det, _mm_add_ps(
+					_mm_sub_ps(_mm_mul_ps(m0x, c4), _mm_mul_ps(vx, c2)),
+					_mm_mul_ps(dx, c5)));
+
+				__m128 d = _mm_mul_ps(inv_det, _mm_add_ps(
+					_mm_sub_ps(_mm_mul_ps(m0x, c6), _mm_mul_ps(m1x, c5)),
+					_mm_mul_ps(vx, c3)));
+
+				// Rejections are phrased like in triangle::intersect,
+				// so NaN lanes are treated the same way there
+				__m128 reject = _mm_or_ps(
+					_mm_or_ps(_mm_cmplt_ps(b, lower), _mm_cmpgt_ps(b, upper)),
+					_mm_or_ps(_mm_cmplt_ps(g, lower), _mm_cmpgt_ps(_mm_add_ps(g, b), upper)));
+
+				__m128 accept = _mm_and_ps(_mm_cmpge_ps(d, zero), _mm_cmple_ps(d, max));
+				accept = _mm_andnot_ps(reject, accept);
+
+				_mm_store_ps(dist.data() + offset, d);
+				_mm_store_ps(alpha.data() + offset, _mm_sub_ps(_mm_sub_ps(one, b), g));
+				_mm_store_ps(beta.data() + offset, b);
+				_mm_store_ps(gamma.data() + offset, g);
+
+				hit_mask |= static_cast<uint32_t>(_mm_movemask_ps(accept)) << offset;
+			}
+
+			// Ignore unoccupied lanes
+			hit_mask &= (1U << packet.count) - 1;
+
+			return reduce(hit_mask, dist.data(), alpha.data(), beta.data(), gamma.data());
+		}
+
+		__attribute__((target("avx")))
+		static triangle_packet::intersection intersect_avx(
+			const triangle_packet& packet, const ray& ray, float max_dist) {
+			fvec3 dir = ray.get_dir();
+
+			__m256 dx = _mm256_set1_ps(dir.x);
+			__m256 dy = _mm256_set1_ps(dir.y);
+			__m256 dz = _mm256_set1_ps(dir.z);
+			__m256 ox = _mm256_set1_ps(ray.origin.x);
+			__m256 oy = _mm256_set1_ps(ray.origin.y);
+			__m256 oz = _mm256_set1_ps(ray.origin.z);
+
+			__m256 one = _mm256_set1_ps(1);
+			__m256 zero = _mm256_setzero_ps();
+			__m256 lower = _mm256_set1_ps(0 - epsilon);
+			__m256 upper = _mm256_set1_ps(1 + epsilon);
+			__m256 max = _mm256_set1_ps(max_dist);
+
+			__m256 ax = _mm256_load_ps(packet.ax.data());
+			__m256 ay = _mm256_load_ps(packet.ay.data());
+			__m256 az = _mm256_load_ps(packet.az.data());
+
+			// m = [a - b, a - c, dir]
+			__m256 m0x = _mm256_sub_ps(ax, _mm256_load_ps(packet.bx.data()));
+			__m256 m0y = _mm256_sub_ps(ay, _mm256_load_ps(packet.by.data()));
+			__m256 m0z = _mm256_sub_ps(az, _mm256_load_ps(packet.bz.data()));
+			__m256 m1x = _mm256_sub_ps(ax, _mm256_load_ps(packet.cx.data()));
+			__m256 m1y = _mm256_sub_ps(ay, _mm256_load_ps(packet.cy.data()));
+			__m256 m1z = _mm256_sub_ps(az, _mm256_load_ps(packet.cz.data()));
+
+			__m256 vx = _mm256_sub_ps(ax, ox);
+			__m256 vy = _mm256_sub_ps(ay, oy);
+			__m256 vz = _mm256_sub_ps(az, oz);
+
+			__m256 c1 = _mm256_sub_ps(_mm256_mul_ps(m1y, dz), _mm256_mul_ps(dy, m1z));
+			__m256 c2 = _mm256_sub_ps(_mm256_mul_ps(m0y, dz), _mm256_mul_ps(dy, m0z));
+			__m256 c3 = _mm256_sub_ps(_mm256_mul_ps(m0y, m1z), _mm256_mul_ps(m1y, m0z));
+			__m256 c4 = _mm256_sub_ps(_mm256_mul_ps(vy, dz), _mm256_mul_ps(dy, vz));
+			__m256 c5 = _mm256_sub_ps(_mm256_mul_ps(m0y, vz), _mm256_mul_ps(vy, m0z));
+			__m256 c6 = _mm256_sub_ps(_mm256_mul_ps(m1y, vz), _mm256_mul_ps(vy, m1z));
+
+			__m256 inv_det = _mm256_div_ps(one, _mm256_add_ps(
+				_mm256_sub_ps(_mm256_mul_ps(m0x, c1), _mm256_mul_ps(m1x, c2)),
+				_mm256_mul_ps(dx, c3)));
+
+			__m256 b = _mm256_mul_ps(inv_det, _mm256_sub_ps(
+				_mm256_sub_ps(_mm256_mul_ps(vx, c1), _mm256_mul_ps(m1x, c4)),
+				_mm256_mul_ps(dx, c6)));
+
+			__m256 g = _mm256_mul_ps(inv_det, _mm256_add_ps(
+				_mm256_sub_ps(_mm256_mul_ps(m0x, c4), _mm256_mul_ps(vx, c2)),
+				_mm256_mul_ps(dx, c5)));
+
+			__m256 d = _mm256_mul_ps(inv_det, _mm256_add_ps(
+				_mm256_sub_ps(_mm256_mul_ps(m0x, c6), _mm256_mul_ps(m1x, c5)),
+				_mm256_mul_ps(vx, c3)));
+
+			// Ordered non-signaling predicates match the scalar comparisons
+			__m256 reject = _mm256_or_ps(
+				_mm256_or_ps(_mm256_cmp_ps(b, lower, _CMP_LT_OQ), _mm256_cmp_ps(b, upper, _CMP_GT_OQ)),
+				_mm256_or_ps(_mm256_cmp_ps(g, lower, _CMP_LT_OQ),
+				             _mm256_cmp_ps(_mm256_add_ps(g, b), upper, _CMP_GT_OQ)));
+
+			__m256 accept = _mm256_and_ps(_mm256_cmp_ps(d, zero, _CMP_GE_OQ), _mm256_cmp_ps(d, max, _CMP_LE_OQ));
+			accept = _mm256_andnot_ps(reject, accept);
+
+			alignas(32) std::array<float, triangle_packet::width> dist, alpha, beta, gamma;
+			_mm256_store_ps(dist.data(), d);
+			_mm256_store_ps(alpha.data(), _mm256_sub_ps(_mm256_sub_ps(one, b), g));
+			_mm256_store_ps(beta.data(), b);
+			_mm256_store_ps(gamma.data(), g);
+
+			// Ignore unoccupied lanes
+			uint32_t hit_mask = _mm256_movemask_ps(accept);
+			hit_mask &= (1U << packet.count) - 1;
+
+			return reduce(hit_mask, dist.data(), alpha.data(), beta.data(), gamma.data());
+		}
+#endif
+
+		static bool is_supported(triangle_packet::kernel kernel) {
+			switch (kernel) {
+			case triangle_packet::kernel::scalar:
+				return true;
+#ifdef PATH_TRACER_TRIANGLE_PACKET_SIMD
+			case triangle_packet::kernel::sse:
+				__builtin_cpu_init();
+				return __builtin_cpu_supports("sse");
+			case triangle_packet::kernel::avx:
+				__builtin_cpu_init();
+				return __builtin_cpu_supports("avx");
+#endif
+			default:
+				return false;
+			}
+		}
+
+		static kernel get(triangle_packet::kernel kernel) {
+			switch (kernel) {
+#ifdef PATH_TRACER_TRIANGLE_PACKET_SIMD
+			case triangle_packet::kernel::sse:
+				return intersect_sse;
+			case triangle_packet::kernel::avx:
+				return intersect_avx;
+#endif
+			default:
+				return intersect_scalar;
+			}
+		}
+
+		static kernel select() {
+			for (auto kernel : {triangle_packet::kernel::avx, triangle_packet::kernel::sse}) {
+				if (is_supported(kernel))
+					return get(kernel);
+			}
+
+			return intersect_scalar;
+		}
+	}
+
+	triangle_packet::intersection triangle_packet::intersect(const ray& ray, float max_dist) const {
+		static const triangle_packet_kernels::kernel kernel = triangle_packet_kernels::select();
+		return kernel(*this, ray, max_dist);
+	}
+
+	triangle_packet::intersection triangle_packet::intersect(const ray& ray, float max_dist, kernel kernel) const {
+		if (!is_supported(kernel))
+			throw std::invalid_argument("Triangle packet kernel is not supported on this CPU.");
+
+		return triangle_packet_kernels::get(kernel)(*this, ray, max_dist);
+	}
+
+	bool triangle_packet::is_supported(kernel kernel) {
+		return triangle_packet_kernels::is_supported(kernel);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "path_tracer/pch.hpp"
+
+#include "path_tracer/geometry/ray.hpp"
+#include "path_tracer/geometry/triangle.hpp"
+#include "path_tracer/math/vec3.hpp"
+
+namespace geometry {
+	// Up to eight triangles stored as structure of arrays, one lane per triangle
+	//
+	// Intersection runs on AVX or SSE when available and falls back to
+	// triangle::intersect otherwise, all paths produce bit-identical results
+	struct triangle_packet {
+		static constexpr uint32_t width = 8;
+
+		// Kernels intersect can run, it picks the widest one the CPU supports
+		enum class kernel {
+			scalar,
+			sse,
+			avx
+		};
+
+		struct intersection {
+			float distance = -1;
+			math::fvec3 barycentric;
+			uint32_t lane;
+
+			bool has_hit() const;
+		};
+
+		alignas(32) std::array<float, width> ax {}, ay {}, az {};
+		alignas(32) std::array<float, width> bx {}, by {}, bz {};
+		alignas(32) std::array<float, width> cx {}, cy {}, cz {};
+
+		// Caller-defined per-lane payload, usually the triangle index
+		std::array<uint32_t, width> indices {};
+
+		// Number of occupied lanes
+		uint32_t count = 0;
+
+		void add(const triangle& triangle, uint32_t index);
+
+		// Nearest hit among the lanes no further than max_dist,
+		// ties go to the lower lane like in a sequential loop
+		intersection intersect(const ray& ray, float max_dist) const;
+
+		// Same as intersect on a given kernel, which has to be supported
+		intersection intersect(const ray& ray, float max_dist, kernel kernel) const;
+
+		static bool is_supported(kernel kernel);
+	};
+}
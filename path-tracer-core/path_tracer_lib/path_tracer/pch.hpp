@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <concepts>
@@ -20,6 +21,7 @@
 #include <queue>
 #include <random>
 #include <regex>
+#include <span>
 #include <sstream>
 #include <stack>
 #include <stdexcept>
@@ -24,6 +24,14 @@ namespace scene {
 		scene::transform inv_transform
 			= transform.inverse();
 
+		return intersect(ray, transform, inv_transform, visualize_kd_tree_depth);
+	}
+
+	model::intersection model::intersect(
+		const ray& ray,
+		const scene::transform& transform,
+		const scene::transform& inv_transform,
+		uint8_t visualize_kd_tree_depth) const {
 		// Transform ray from world space to local space
 		// This method leaves the length of the ray normalized
 		auto view_ray = ray.transform(inv_transform);
@@ -70,4 +78,32 @@ namespace scene {
 			nearest_hit.barycentric
 		};
 	}
+
+	bool model::occluded(
+		const ray& ray,
+		const scene::transform& transform,
+		const scene::transform& inv_transform,
+		float max_dist) const {
+		auto view_ray = ray.transform(inv_transform);
+
+		auto bounds_hit = aabb.intersect(view_ray);
+		if (!bounds_hit.has_hit())
+			return false;
+
+		// Bring max_dist into local space, the inverse of
+		// how intersect scales hit distances back to world space
+		float local_max_dist = max_dist;
+		if (max_dist != std::numeric_limits<float>::max())
+			local_max_dist = max_dist / length(transform.basis * view_ray.get_dir());
+
+		if (bounds_hit.near > local_max_dist)
+			return false;
+
+		for (const auto& surface : surfaces) {
+			if (surface.mesh->occluded(view_ray, local_max_dist))
+				return true;
+		}
+
+		return false;
+	}
 };
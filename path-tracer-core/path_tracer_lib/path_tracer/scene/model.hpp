@@ -33,5 +33,18 @@ namespace scene {
 		void recalculate_aabb();
 
 		intersection intersect(const geometry::ray& ray, uint8_t visualize_kd_tree_depth = 0) const;
+
+		// Skips the entity lookup and matrix inverse when
+		// the caller has baked the global transforms ahead of time
+		intersection intersect(const geometry::ray& ray,
+		                       const scene::transform& transform,
+		                       const scene::transform& inv_transform,
+		                       uint8_t visualize_kd_tree_depth = 0) const;
+
+		// Any-hit query for shadow rays, max_dist is in world space
+		bool occluded(const geometry::ray& ray,
+		              const scene::transform& transform,
+		              const scene::transform& inv_transform,
+		              float max_dist = std::numeric_limits<float>::max()) const;
 	};
 }
@@ -0,0 +1,41 @@
+#include "path_tracer/util/octahedral.hpp"
+
+#include "path_tracer/math/vec2.hpp"
+
+using namespace math;
+
+namespace util {
+	static uint32_t encode_snorm16(float value) {
+		return static_cast<uint16_t>(static_cast<int16_t>(math::round(math::clamp(value, -1.0F, 1.0F) * 32767)));
+	}
+
+	static float decode_snorm16(uint32_t value) {
+		return math::max(static_cast<int16_t>(value) / 32767.0F, -1.0F);
+	}
+
+	uint32_t encode_octahedral(const fvec3& dir) {
+		// Project onto the octahedron, then fold the lower half over the upper one
+		float sum = abs(dir.x) + abs(dir.y) + abs(dir.z);
+		fvec2 oct(dir.x / sum, dir.y / sum);
+
+		if (dir.z < 0) {
+			oct = fvec2(
+				(1 - abs(oct.y)) * (oct.x >= 0 ? 1 : -1),
+				(1 - abs(oct.x)) * (oct.y >= 0 ? 1 : -1));
+		}
+
+		return encode_snorm16(oct.x) | (encode_snorm16(oct.y) << 16);
+	}
+
+	fvec3 decode_octahedral(uint32_t encoded) {
+		fvec2 oct(decode_snorm16(encoded & 0xFFFF), decode_snorm16(encoded >> 16));
+		fvec3 dir(oct.x, oct.y, 1 - abs(oct.x) - abs(oct.y));
+
+		if (dir.z < 0) {
+			dir.x = (1 - abs(oct.y)) * (oct.x >= 0 ? 1 : -1);
+			dir.y = (1 - abs(oct.x)) * (oct.y >= 0 ? 1 : -1);
+		}
+
+		return normalize(dir);
+	}
+}
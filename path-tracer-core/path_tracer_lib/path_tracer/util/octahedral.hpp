@@ -0,0 +1,11 @@
+#pragma once
+
+#include "path_tracer/pch.hpp"
+
+#include "path_tracer/math/vec3.hpp"
+
+namespace util {
+	// Packs a unit vector into two 16-bit snorm octahedral coordinates
+	uint32_t encode_octahedral(const math::fvec3& dir);
+	math::fvec3 decode_octahedral(uint32_t encoded);
+}
@@ -82,7 +82,12 @@ namespace util {
 			future->_ready.test_and_set();
 			future->_ready.notify_all();
 
-			// This is needed so that quit_when_ready futures can be checked again
+			// This is needed so that quit_when_ready futures can be checked again.
+			// Taking the lock first keeps a waiter from missing the notification between its check and its sleep
+			{
+				std::unique_lock lock(queue_mutex);
+			}
+
 			notifier.notify_all();
 		}
 	}
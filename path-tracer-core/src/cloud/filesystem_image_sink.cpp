@@ -0,0 +1,41 @@
+#include "filesystem_image_sink.hpp"
+
+namespace cloud {
+    filesystem_image_sink::filesystem_image_sink(std::filesystem::path directory)
+        : m_directory(std::move(directory)) {
+        std::filesystem::create_directories(m_directory);
+    }
+
+    void filesystem_image_sink::publish(const std::string& name, std::vector<uint8_t> data) {
+        std::filesystem::path path = m_directory / name;
+        std::filesystem::path partial_path = path;
+        partial_path += ".partial";
+
+        // Renamed into place once written, so that readers never see half an image
+        {
+            std::ofstream file(partial_path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                throw std::runtime_error(fmt::format("Failed to open {} for writing", partial_path.string()));
+            }
+
+            file.write(reinterpret_cast<const char*>(data.data()), data.size());
+            if (!file) {
+                throw std::runtime_error(fmt::format("Failed to write {}", partial_path.string()));
+            }
+        }
+
+        std::filesystem::rename(partial_path, path);
+        spdlog::info("Wrote {}", path.string());
+    }
+
+    std::vector<uint8_t> filesystem_image_sink::fetch(const std::string& name) {
+        std::filesystem::path path = m_directory / name;
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error(fmt::format("Failed to open {}", path.string()));
+        }
+
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "pch.hpp"
+#include "image_sink.hpp"
+
+namespace cloud {
+    // Writes images into a local directory, for running without S3
+    class filesystem_image_sink : public image_sink {
+    public:
+        explicit filesystem_image_sink(std::filesystem::path directory);
+
+        void publish(const std::string& name, std::vector<uint8_t> data) override;
+        std::vector<uint8_t> fetch(const std::string& name) override;
+
+    private:
+        std::filesystem::path m_directory;
+    };
+}
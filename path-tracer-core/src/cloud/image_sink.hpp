@@ -0,0 +1,18 @@
+#pragma once
+
+#include "pch.hpp"
+
+namespace cloud {
+    // Where the worker publishes the images it encodes, the final one as well as previews,
+    // and the checkpoints it may later resume from
+    class image_sink {
+    public:
+        virtual ~image_sink() = default;
+
+        // Replaces any image published earlier under the same name
+        virtual void publish(const std::string& name, std::vector<uint8_t> data) = 0;
+
+        // Reads back what was published under the name, throws if there is nothing
+        virtual std::vector<uint8_t> fetch(const std::string& name) = 0;
+    };
+}
@@ -0,0 +1,203 @@
+#include "local_transport.hpp"
+#include "ray_wire.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cloud {
+    namespace local_transport_format {
+        static void write_all(int socket, const void* data, size_t size) {
+            const auto* bytes = static_cast<const uint8_t*>(data);
+
+            while (size > 0) {
+                ssize_t written = ::send(socket, bytes, size, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    throw std::runtime_error(fmt::format("Failed to send to worker: {}", std::strerror(errno)));
+
+                bytes += written;
+                size -= written;
+            }
+        }
+
+        // Returns false if the other side closed the connection
+        static bool read_all(int socket, void* data, size_t size) {
+            auto* bytes = static_cast<uint8_t*>(data);
+
+            while (size > 0) {
+                ssize_t read = ::recv(socket, bytes, size, 0);
+                if (read < 0 && errno == EINTR)
+                    continue;
+                if (read <= 0)
+                    return false;
+
+                bytes += read;
+                size -= read;
+            }
+
+            return true;
+        }
+
+        static sockaddr_un get_address(const std::filesystem::path& path) {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+
+            if (path.native().size() >= sizeof(address.sun_path))
+                throw std::runtime_error(fmt::format("Socket path {} is too long", path.string()));
+
+            std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+            return address;
+        }
+    }
+
+    local_transport::local_transport(const std::filesystem::path& directory, uint32_t rank, uint32_t num_workers) : m_rank(rank) {
+        using namespace local_transport_format;
+
+        if (rank >= num_workers)
+            throw std::runtime_error(fmt::format("Worker rank {} is out of range for {} workers", rank, num_workers));
+
+        std::filesystem::create_directories(directory);
+
+        m_connections.resize(num_workers);
+
+        // Listen before connecting, so that higher ranks can connect while this one waits on lower ones
+        std::filesystem::path path = get_socket_path(directory, rank);
+        std::filesystem::remove(path);
+
+        socket_handle listener(::socket(AF_UNIX, SOCK_STREAM, 0));
+        sockaddr_un address = get_address(path);
+        if (listener.get() < 0 || ::bind(listener.get(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener.get(), num_workers) != 0)
+            throw std::runtime_error(fmt::format("Failed to listen on {}: {}", path.string(), std::strerror(errno)));
+
+        // Lower ranks are connected to, and each connection starts with the rank of whoever connected
+        for (uint32_t peer = 0; peer < rank; peer++) {
+            sockaddr_un peer_address = get_address(get_socket_path(directory, peer));
+            auto deadline = std::chrono::steady_clock::now() + connect_timeout;
+
+            auto connection = std::make_unique<local_transport::connection>();
+            while (true) {
+                connection->socket.reset(::socket(AF_UNIX, SOCK_STREAM, 0));
+                if (::connect(connection->socket.get(), reinterpret_cast<sockaddr*>(&peer_address), sizeof(peer_address)) == 0)
+                    break;
+
+                if (std::chrono::steady_clock::now() > deadline)
+                    throw std::runtime_error(fmt::format("Timed out connecting to worker {}", peer));
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+
+            write_all(connection->socket.get(), &rank, sizeof(rank));
+            m_connections[peer] = std::move(connection);
+        }
+
+        for (uint32_t accepted = rank + 1; accepted < num_workers; accepted++) {
+            auto connection = std::make_unique<local_transport::connection>();
+            connection->socket.reset(::accept(listener.get(), nullptr, nullptr));
+
+            uint32_t peer;
+            if (connection->socket.get() < 0 || !read_all(connection->socket.get(), &peer, sizeof(peer)) || peer <= rank || peer >= num_workers || m_connections[peer])
+                throw std::runtime_error("Failed to accept a worker connection");
+
+            m_connections[peer] = std::move(connection);
+        }
+
+        listener.reset();
+        std::filesystem::remove(path);
+
+        for (auto& connection : m_connections) {
+            if (connection)
+                connection->receiver = std::thread(&local_transport::receive, this, std::ref(*connection));
+        }
+
+        spdlog::info("Worker {} connected to {} other workers", rank, num_workers - 1);
+    }
+
+    local_transport::~local_transport() {
+        // Unblocks the receivers, which then see the connection as closed
+        for (auto& connection : m_connections) {
+            if (connection)
+                ::shutdown(connection->socket.get(), SHUT_RDWR);
+        }
+
+        // The sockets are closed along with the connections
+        for (auto& connection : m_connections) {
+            if (connection)
+                connection->receiver.join();
+        }
+    }
+
+    void local_transport::send_rays(uint32_t destination, std::span<const uint8_t> frame) {
+        using namespace local_transport_format;
+
+        if (destination >= m_connections.size() || !m_connections[destination])
+            throw std::runtime_error(fmt::format("Worker {} has no connection to worker {}", m_rank, destination));
+
+        connection& connection = *m_connections[destination];
+
+        std::lock_guard lock(connection.send_mutex);
+        if (!connection.connected)
+            return;
+
+        try {
+            write_all(connection.socket.get(), frame.data(), frame.size());
+        }
+        catch (const std::exception& e) {
+            // Part of the frame may have gone out, which leaves no way to find the next one
+            spdlog::error("Dropping connection to worker {}: {}", destination, e.what());
+            connection.connected = false;
+            ::shutdown(connection.socket.get(), SHUT_RDWR);
+        }
+    }
+
+    bool local_transport::recv_rays(std::vector<uint8_t>& frame, std::chrono::milliseconds timeout) {
+        return m_inbox.wait_dequeue_timed(frame, timeout);
+    }
+
+    bool local_transport::is_connected(uint32_t rank) const {
+        return rank < m_connections.size() && m_connections[rank] && m_connections[rank]->connected;
+    }
+
+    void local_transport::receive(connection& connection) {
+        using namespace local_transport_format;
+
+        while (true) {
+            std::vector<uint8_t> frame(sizeof(ray_wire::header));
+            if (!read_all(connection.socket.get(), frame.data(), frame.size()))
+                break;
+
+            // A bad header leaves no way to find the next frame, so the connection is dropped
+            ray_wire::header header;
+            try {
+                header = ray_wire::read_header(frame);
+            }
+            catch (const std::exception& e) {
+                spdlog::error("Dropping worker connection: {}", e.what());
+                break;
+            }
+
+            frame.resize(sizeof(ray_wire::header) + header.payload_size);
+            if (!read_all(connection.socket.get(), frame.data() + sizeof(ray_wire::header), header.payload_size))
+                break;
+
+            m_inbox.enqueue(std::move(frame));
+        }
+
+        // Only after the last frame is queued, so that whoever sees this has every frame the worker sent
+        connection.connected = false;
+    }
+
+    void local_transport::socket_handle::reset(int socket) {
+        if (m_socket >= 0)
+            ::close(m_socket);
+
+        m_socket = socket;
+    }
+
+    std::filesystem::path local_transport::get_socket_path(const std::filesystem::path& directory, uint32_t rank) {
+        return directory / fmt::format("worker_{}.sock", rank);
+    }
+}
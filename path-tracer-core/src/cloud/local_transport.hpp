@@ -0,0 +1,57 @@
+#pragma once
+
+#include "pch.hpp"
+#include "transport.hpp"
+#include <concurrentqueue/blockingconcurrentqueue.h>
+#include <mutex>
+#include <thread>
+
+namespace cloud {
+    // Connects the workers of one machine over Unix domain sockets in the given directory.
+    // Every pair of workers shares a connection, the constructor returns once all are up
+    class local_transport : public transport {
+    public:
+        local_transport(const std::filesystem::path& directory, uint32_t rank, uint32_t num_workers);
+        ~local_transport() override;
+
+        void send_rays(uint32_t destination, std::span<const uint8_t> frame) override;
+        bool recv_rays(std::vector<uint8_t>& frame, std::chrono::milliseconds timeout) override;
+        bool is_connected(uint32_t rank) const override;
+
+    private:
+        // Owns a socket descriptor, so that none leak when the constructor throws
+        class socket_handle {
+        public:
+            explicit socket_handle(int socket = -1) : m_socket(socket) {}
+            socket_handle(const socket_handle&) = delete;
+            socket_handle& operator=(const socket_handle&) = delete;
+            ~socket_handle() { reset(); }
+
+            int get() const { return m_socket; }
+            void reset(int socket = -1);
+
+        private:
+            int m_socket;
+        };
+
+        struct connection {
+            socket_handle socket;
+            std::mutex send_mutex;
+            std::thread receiver;
+            std::atomic<bool> connected = true;
+        };
+
+        // Reads frames from one connection into the inbox until the other side closes it
+        void receive(connection& connection);
+
+        static std::filesystem::path get_socket_path(const std::filesystem::path& directory, uint32_t rank);
+
+    private:
+        // Workers that started late have this long to create their socket
+        static constexpr std::chrono::seconds connect_timeout{60};
+
+        uint32_t m_rank;
+        std::vector<std::unique_ptr<connection>> m_connections;
+        moodycamel::BlockingConcurrentQueue<std::vector<uint8_t>> m_inbox;
+    };
+}
@@ -0,0 +1,57 @@
+#include "ray_wire.hpp"
+
+#include <lz4.h>
+
+namespace cloud::ray_wire {
+    header read_header(std::span<const uint8_t> frame) {
+        if (frame.size() < sizeof(header))
+            throw std::runtime_error("Ray batch is shorter than its header");
+
+        header header;
+        std::memcpy(&header, frame.data(), sizeof(header));
+
+        if (header.magic != magic)
+            throw std::runtime_error("Ray batch has the wrong magic");
+
+        if (header.version != version)
+            throw std::runtime_error("Ray batch version " + std::to_string(header.version) + " isn't supported");
+
+        if (header.compression > static_cast<uint16_t>(compression::lz4))
+            throw std::runtime_error("Ray batch uses an unknown compression");
+
+        if (header.payload_size > max_records_size)
+            throw std::runtime_error("Ray batch is too large to decode");
+
+        return header;
+    }
+
+    bool compress(std::span<const uint8_t> records, compression compression, std::vector<uint8_t>& output) {
+        if (compression != compression::lz4)
+            return false;
+
+        size_t offset = output.size();
+        output.resize(offset + LZ4_compressBound(static_cast<int>(records.size())));
+
+        int size = LZ4_compress_default(reinterpret_cast<const char*>(records.data()), reinterpret_cast<char*>(output.data() + offset),
+            static_cast<int>(records.size()), static_cast<int>(output.size() - offset));
+
+        if (size <= 0 || static_cast<size_t>(size) >= records.size()) {
+            output.resize(offset);
+            return false;
+        }
+
+        output.resize(offset + size);
+        return true;
+    }
+
+    void decompress(std::span<const uint8_t> payload, compression compression, std::span<uint8_t> records) {
+        if (compression != compression::lz4)
+            throw std::runtime_error("Ray batch uses an unknown compression");
+
+        int size = LZ4_decompress_safe(reinterpret_cast<const char*>(payload.data()), reinterpret_cast<char*>(records.data()),
+            static_cast<int>(payload.size()), static_cast<int>(records.size()));
+
+        if (size < 0 || static_cast<size_t>(size) != records.size())
+            throw std::runtime_error("Ray batch failed to decompress");
+    }
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "pch.hpp"
+#include "models/ray_message.hpp"
+#include <path_tracer/geometry/aabb.hpp>
+#include <path_tracer/util/octahedral.hpp>
+#include <bit>
+#include <cstring>
+#include <span>
+
+namespace cloud {
+    // Binary format of the batches workers exchange. A frame is a header followed by
+    // count fixed size records, all little-endian and without padding, so a record is
+    // read straight from the receive buffer by its index
+    namespace ray_wire {
+        static_assert(std::endian::native == std::endian::little, "ray_wire copies fields in host byte order");
+
+        static constexpr uint32_t magic = 0x42525450; // "PTRB"
+        static constexpr uint16_t version = 1;
+
+        // Frames larger than this are rejected before allocating for them
+        static constexpr size_t max_records_size = 1 << 30;
+
+        using compression = models::ray_compression;
+
+        struct header {
+            uint32_t magic;
+            uint16_t version;
+            uint16_t compression;
+            uint32_t type;
+            uint32_t source;
+            uint32_t count;
+            uint32_t payload_size; // Bytes after the header, compressed or not
+        };
+
+        static_assert(sizeof(header) == 24 && std::is_trivially_copyable_v<header>);
+
+        class writer {
+        public:
+            explicit writer(uint8_t* data) : m_data(data) {}
+
+            template <typename T>
+            void put(const T& value) {
+                static_assert(std::is_arithmetic_v<T>);
+                std::memcpy(m_data, &value, sizeof(T));
+                m_data += sizeof(T);
+            }
+
+            void put(const math::fvec3& value) {
+                put(value.x);
+                put(value.y);
+                put(value.z);
+            }
+
+            void put(const geometry::ray& ray) {
+                put(ray.origin);
+                put(ray.get_dir());
+            }
+
+        private:
+            uint8_t* m_data;
+        };
+
+        class reader {
+        public:
+            explicit reader(const uint8_t* data) : m_data(data) {}
+
+            template <typename T>
+            T get() {
+                static_assert(std::is_arithmetic_v<T>);
+                T value;
+                std::memcpy(&value, m_data, sizeof(T));
+                m_data += sizeof(T);
+                return value;
+            }
+
+            math::fvec3 get_fvec3() {
+                float x = get<float>();
+                float y = get<float>();
+                float z = get<float>();
+                return math::fvec3(x, y, z);
+            }
+
+            geometry::ray get_ray() {
+                math::fvec3 origin = get_fvec3();
+                return geometry::ray(origin, get_fvec3());
+            }
+
+        private:
+            const uint8_t* m_data;
+        };
+
+        // Fixed size layout of every type that goes over the wire
+        template <typename T>
+        struct record;
+
+        template <>
+        struct record<models::ray_query> {
+            static constexpr size_t size = 4 + 24;
+
+            static void write(uint8_t* data, const models::ray_query& query) {
+                writer writer(data);
+                writer.put(query.slot);
+                writer.put(query.ray);
+            }
+
+            static models::ray_query read(const uint8_t* data) {
+                reader reader(data);
+                uint32_t slot = reader.get<uint32_t>();
+                return {slot, reader.get_ray()};
+            }
+        };
+
+        // Normals are octahedral encoded, everything else keeps full precision
+        template <>
+        struct record<models::surface> {
+            static constexpr size_t size = 12 + 4 + 12 + 12 + 16 + 1;
+
+            static void write(uint8_t* data, const models::surface& surface) {
+                writer writer(data);
+                writer.put(surface.position);
+                writer.put(util::encode_octahedral(surface.normal));
+                writer.put(surface.albedo);
+                writer.put(surface.emissive);
+                writer.put(surface.opacity);
+                writer.put(surface.roughness);
+                writer.put(surface.metallic);
+                writer.put(surface.ior);
+                writer.put<uint8_t>(surface.shadow_catcher);
+            }
+
+            static models::surface read(const uint8_t* data) {
+                reader reader(data);
+                models::surface surface;
+                surface.position = reader.get_fvec3();
+                surface.normal = util::decode_octahedral(reader.get<uint32_t>());
+                surface.albedo = reader.get_fvec3();
+                surface.emissive = reader.get_fvec3();
+                surface.opacity = reader.get<float>();
+                surface.roughness = reader.get<float>();
+                surface.metallic = reader.get<float>();
+                surface.ior = reader.get<float>();
+                surface.shadow_catcher = reader.get<uint8_t>() != 0;
+                return surface;
+            }
+        };
+
+        // Misses leave the surface zeroed, which compresses to almost nothing
+        template <>
+        struct record<models::intersect_reply> {
+            static constexpr size_t size = 4 + 1 + 4 + record<models::surface>::size;
+
+            static void write(uint8_t* data, const models::intersect_reply& reply) {
+                writer writer(data);
+                writer.put(reply.slot);
+                writer.put<uint8_t>(reply.result.hit);
+                writer.put(reply.result.distance);
+
+                if (reply.result.hit)
+                    record<models::surface>::write(data + 9, reply.result.surface);
+                else
+                    std::memset(data + 9, 0, record<models::surface>::size);
+            }
+
+            static models::intersect_reply read(const uint8_t* data) {
+                reader reader(data);
+                models::intersect_reply reply{};
+                reply.slot = reader.get<uint32_t>();
+                reply.result.hit = reader.get<uint8_t>() != 0;
+                reply.result.distance = reader.get<float>();
+
+                if (reply.result.hit)
+                    reply.result.surface = record<models::surface>::read(data + 9);
+
+                return reply;
+            }
+        };
+
+        template <>
+        struct record<models::occluded_reply> {
+            static constexpr size_t size = 4 + 1;
+
+            static void write(uint8_t* data, const models::occluded_reply& reply) {
+                writer writer(data);
+                writer.put(reply.slot);
+                writer.put<uint8_t>(reply.occluded);
+            }
+
+            static models::occluded_reply read(const uint8_t* data) {
+                reader reader(data);
+                uint32_t slot = reader.get<uint32_t>();
+                return {slot, reader.get<uint8_t>() != 0};
+            }
+        };
+
+        template <>
+        struct record<geometry::aabb> {
+            static constexpr size_t size = 24;
+
+            static void write(uint8_t* data, const geometry::aabb& aabb) {
+                writer writer(data);
+                writer.put(aabb.min);
+                writer.put(aabb.max);
+            }
+
+            static geometry::aabb read(const uint8_t* data) {
+                reader reader(data);
+                math::fvec3 min = reader.get_fvec3();
+                return geometry::aabb(min, reader.get_fvec3());
+            }
+        };
+
+        // Records of a frame, decoded one at a time as they are accessed
+        template <typename T>
+        class batch_view {
+        public:
+            class iterator {
+            public:
+                iterator(const uint8_t* data) : m_data(data) {}
+
+                T operator*() const { return record<T>::read(m_data); }
+                iterator& operator++() { m_data += record<T>::size; return *this; }
+                bool operator!=(const iterator& other) const { return m_data != other.m_data; }
+
+            private:
+                const uint8_t* m_data;
+            };
+
+        public:
+            batch_view(std::span<const uint8_t> records) : m_records(records) {}
+
+            size_t size() const { return m_records.size() / record<T>::size; }
+            T operator[](size_t index) const { return record<T>::read(m_records.data() + index * record<T>::size); }
+
+            iterator begin() const { return iterator(m_records.data()); }
+            iterator end() const { return iterator(m_records.data() + m_records.size()); }
+
+        private:
+            std::span<const uint8_t> m_records;
+        };
+
+        // Reads the header at the start of a frame, throws if it isn't one of this version.
+        // Only the header is checked, so the transport can call this before the payload arrives
+        header read_header(std::span<const uint8_t> frame);
+
+        // Appends the compressed records to output, returns false if they didn't get smaller
+        bool compress(std::span<const uint8_t> records, compression compression, std::vector<uint8_t>& output);
+
+        // Throws unless payload expands to exactly the size of records
+        void decompress(std::span<const uint8_t> payload, compression compression, std::span<uint8_t> records);
+
+        // Replaces frame with an encoded batch of items
+        template <typename T>
+        void encode(models::message_type type, uint32_t source, std::span<const T> items, compression compression, std::vector<uint8_t>& frame) {
+            header header{magic, version, static_cast<uint16_t>(compression::none), static_cast<uint32_t>(type), source, static_cast<uint32_t>(items.size()), 0};
+
+            size_t records_size = items.size() * record<T>::size;
+            if (records_size > max_records_size)
+                throw std::runtime_error("Ray batch is too large to encode");
+
+            frame.resize(sizeof(header) + records_size);
+            for (size_t i = 0; i < items.size(); i++)
+                record<T>::write(frame.data() + sizeof(header) + i * record<T>::size, items[i]);
+
+            if (compression != compression::none && !items.empty()) {
+                std::vector<uint8_t> compressed(sizeof(header));
+                if (compress(std::span<const uint8_t>(frame).subspan(sizeof(header)), compression, compressed)) {
+                    frame.swap(compressed);
+                    header.compression = static_cast<uint16_t>(compression);
+                }
+            }
+
+            header.payload_size = static_cast<uint32_t>(frame.size() - sizeof(header));
+            std::memcpy(frame.data(), &header, sizeof(header));
+        }
+
+        // Views the records in place, only compressed frames are expanded into scratch first
+        template <typename T>
+        batch_view<T> decode(std::span<const uint8_t> frame, std::vector<uint8_t>& scratch) {
+            header header = read_header(frame);
+            if (frame.size() - sizeof(ray_wire::header) != header.payload_size)
+                throw std::runtime_error("Ray batch size doesn't match its header");
+
+            std::span<const uint8_t> payload = frame.subspan(sizeof(ray_wire::header));
+
+            size_t records_size = static_cast<size_t>(header.count) * record<T>::size;
+            if (records_size > max_records_size)
+                throw std::runtime_error("Ray batch is too large to decode");
+
+            if (header.compression == static_cast<uint16_t>(compression::none)) {
+                if (payload.size() != records_size)
+                    throw std::runtime_error("Ray batch size doesn't match its record count");
+
+                return batch_view<T>(payload);
+            }
+
+            // LZ4 expands its input at most 255 times, so a corrupt count can't make us allocate more than that
+            if (records_size / 256 > payload.size())
+                throw std::runtime_error("Ray batch record count doesn't fit its compressed size");
+
+            scratch.resize(records_size);
+            decompress(payload, static_cast<compression>(header.compression), scratch);
+            return batch_view<T>(scratch);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#include "s3_image_sink.hpp"
+#include "s3.hpp"
+
+namespace cloud {
+    s3_image_sink::s3_image_sink(std::string bucket, std::string prefix)
+        : m_bucket(std::move(bucket)), m_prefix(std::move(prefix)) {
+    }
+
+    void s3_image_sink::publish(const std::string& name, std::vector<uint8_t> data) {
+        std::variant<std::filesystem::path, std::vector<uint8_t>> input{std::move(data)};
+        s3_upload_object(m_bucket, m_prefix + name, input);
+    }
+
+    std::vector<uint8_t> s3_image_sink::fetch(const std::string& name) {
+        std::variant<std::filesystem::path, std::vector<uint8_t>> output{std::vector<uint8_t>()};
+        s3_download_object(m_bucket, m_prefix + name, output);
+
+        auto& data = std::get<std::vector<uint8_t>>(output);
+        if (data.empty()) {
+            throw std::runtime_error(fmt::format("Failed to download s3://{}/{}{}", m_bucket, m_prefix, name));
+        }
+
+        return std::move(data);
+    }
+}
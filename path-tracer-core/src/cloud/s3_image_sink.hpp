@@ -0,0 +1,19 @@
+#pragma once
+
+#include "pch.hpp"
+#include "image_sink.hpp"
+
+namespace cloud {
+    // Uploads images to the bucket, keyed by the prefix followed by the name
+    class s3_image_sink : public image_sink {
+    public:
+        s3_image_sink(std::string bucket, std::string prefix);
+
+        void publish(const std::string& name, std::vector<uint8_t> data) override;
+        std::vector<uint8_t> fetch(const std::string& name) override;
+
+    private:
+        std::string m_bucket;
+        std::string m_prefix;
+    };
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "pch.hpp"
+#include <chrono>
+#include <span>
+
+namespace cloud {
+    // Moves ray batches between the workers of one render, addressed by rank.
+    // Frames are encoded with ray_wire, which the transport reads the header of to delimit them
+    class transport {
+    public:
+        virtual ~transport() = default;
+
+        // Safe to call from several threads at once, frames to a worker that is no longer connected are dropped
+        virtual void send_rays(uint32_t destination, std::span<const uint8_t> frame) = 0;
+
+        // Waits up to timeout for a batch from any worker, returns false if none arrived
+        virtual bool recv_rays(std::vector<uint8_t>& frame, std::chrono::milliseconds timeout) = 0;
+
+        // False once the connection to a worker closed or broke,
+        // the frames it delivered before that are still received first
+        virtual bool is_connected(uint32_t rank) const = 0;
+    };
+}
@@ -30,33 +30,37 @@ namespace models {
         ACCUMULATE
     };
 
-    // TODO: Improve memory mangement
-    /*
-        Don't store intersect_result directly.
-        Use UUID.
-            - Have different types of rays
-                - Intersection Rays
-                - Rays with sample
-        Use UUID to map rays to a result
-    */
-    
+    // How far a ray got in visiting the shards it passes through, front to back
+    struct shard_walk {
+        float entry = -std::numeric_limits<float>::max();
+        uint32_t shard = std::numeric_limits<uint32_t>::max();
+    };
+
+    // Payload of a ray in flight, kept in the worker's slot array
+    // while the queues only pass ray_handle around
     struct cloud_ray {
         uint64_t uuid;
 
         geometry::ray ray;
         std::optional<geometry::ray> direct_light_ray;
-        
-        float object_intersect_distance; 
-        bool direct_light_intersect_result;
+
+        // Nearest hit and occlusion over the shards visited so far
+        std::optional<models::surface> surface;
+        float hit_distance;
+        bool direct_light_occluded;
+        models::shard_walk shard_walk;
 
         math::fvec3 color;
         float alpha;
         math::fvec3 scale;
 
         uint8_t bounce;
-        ray_stage stage;
     };
 
-    // TODO: Define Serialization
-    //NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(cloud_ray, uuid, geometry_ray, intersect_ray, intersect_result, direct_light_intersect_result, samples, bounce, stage)
+    // Queue entry for a ray, the stage is implied by the queue it's in
+    struct ray_handle {
+        uint32_t slot;
+    };
+
+    // cloud_ray never leaves rank 0, only ray_query and the reply types cross the wire (see cloud/ray_wire.hpp)
 }
\ No newline at end of file
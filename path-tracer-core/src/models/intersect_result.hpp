@@ -3,13 +3,26 @@
 #include "pch.hpp"
 #include "vectors.hpp"
 #include <path_tracer/core/material.hpp>
+#include <path_tracer/math/mat3.hpp>
 
 namespace models {
+    // Material inputs at a hit point, enough to shade it without the scene
+    struct surface {
+        math::fvec3 position;
+        math::fvec3 normal; // Normal map applied
+        math::fvec3 albedo;
+        math::fvec3 emissive;
+        float opacity;
+        float roughness;
+        float metallic;
+        float ior;
+        bool shadow_catcher;
+    };
+
     struct intersect_result_min {
         bool hit;
         float distance;
-        math::fvec3 position;
-        math::fvec3 normal;
+        models::surface surface;
     };
     
     struct intersect_result {
@@ -27,6 +40,20 @@ namespace models {
 
 		    return tbn * material->get_normal(tex_coord);
         }
+
+        models::surface get_surface() const {
+            return {
+                position,
+                get_normal(),
+                material->get_albedo(tex_coord),
+                material->get_emissive(tex_coord),
+                material->get_opacity(tex_coord),
+                material->get_roughness(tex_coord),
+                material->get_metallic(tex_coord),
+                material->ior,
+                material->shadow_catcher
+            };
+        }
 	};
     
     // NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(intersect_result, hit, distance, position, normal, albedo, 
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "pch.hpp"
+#include "intersect_result.hpp"
+#include <path_tracer/geometry/ray.hpp>
+
+namespace models {
+    enum class message_type : uint32_t {
+        intersect,          // ray_query batch, answered with intersect_reply
+        occluded,           // ray_query batch, answered with occluded_reply
+        intersect_result,
+        occluded_result,
+        shutdown,           // The render is done, no payload
+        shard_bounds        // One aabb, the world bounds of the sender's shard
+    };
+
+    // Applied to each batch that gets smaller from it
+    enum class ray_compression : uint16_t {
+        none,
+        lz4
+    };
+
+    // A ray another worker asks about, the slot identifies it at the sender
+    struct ray_query {
+        uint32_t slot;
+        geometry::ray ray;
+    };
+
+    struct intersect_reply {
+        uint32_t slot;
+        intersect_result_min result;
+    };
+
+    struct occluded_reply {
+        uint32_t slot;
+        bool occluded;
+    };
+}
@@ -1,12 +1,25 @@
 #pragma once
 
 #include "pch.hpp"
+#include "ray_message.hpp"
+#include <path_tracer/core/mesh.hpp>
 
 using mesh_name = std::string;
 using primitives = std::vector<int>;
 using worker_id = std::string;
 
+namespace core {
+    NLOHMANN_JSON_SERIALIZE_ENUM(acceleration_structure, {
+        {acceleration_structure::kd_tree, "kd_tree"},
+        {acceleration_structure::bvh, "bvh"}
+    })
+}
+
 namespace models {
+    NLOHMANN_JSON_SERIALIZE_ENUM(ray_compression, {
+        {ray_compression::none, "none"},
+        {ray_compression::lz4, "lz4"}
+    })
 
     struct work_info {
         std::map<mesh_name, primitives> work;
@@ -14,6 +27,16 @@ namespace models {
         NLOHMANN_DEFINE_TYPE_INTRUSIVE(work_info, work, total_size)
     };
 
+    // Rays each stage thread dequeues and enqueues at once
+    struct batch_info {
+        uint32_t object_intersection = 256;
+        uint32_t direct_lighting_intersection = 256;
+        uint32_t shading = 256;
+        uint32_t accumulate = 256;
+
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(batch_info, object_intersection, direct_lighting_intersection, shading, accumulate)
+    };
+
     struct worker_info {
         work_info scene_info;
         std::string scene_bucket;
@@ -23,11 +46,97 @@ namespace models {
         std::string sns_topic_arn;
         int num_workers;
 
-        int samples;
+        int samples; // Per pixel, the most any pixel gets when target_error is set
         int bounces;
         float X;
         float Y;
 
-        NLOHMANN_DEFINE_TYPE_INTRUSIVE(worker_info, scene_info, scene_bucket, scene_root, worker_id, sqs_queue_arn, sns_topic_arn, num_workers, samples, bounces, X, Y)
+        // Optional settings, left at their defaults when missing from the payload
+        core::acceleration_structure acceleration = core::acceleration_structure::kd_tree;
+        std::string mesh_cache_directory = "/tmp/mesh_cache"; // Empty disables the cache
+        batch_info batch_sizes;
+        uint32_t max_in_flight_rays = 1 << 16; // Camera rays generated ahead of accumulation
+        uint32_t tile_size = 32; // Rays are generated and completed in square tiles of this many pixels a side
+        bool fuse_stages = true; // Trace each bounce in a single stage when num_workers is 1
+        uint32_t worker_rank = 0; // Rank 0 traces the camera rays, the others answer its queries for their shard
+        std::string transport_directory = ""; // Unix sockets of workers sharing this machine, needed when num_workers > 1
+        models::ray_compression ray_compression = models::ray_compression::none; // Worth it when workers are on different machines
+        float preview_interval = 0; // Seconds between preview images, 0 disables them
+        uint32_t preview_samples = 0; // Also publish a preview whenever this many more samples per pixel are done, 0 disables them
+        std::string output_directory = ""; // Writes images here instead of uploading them next to the scene
+        float checkpoint_interval = 0; // Seconds between checkpoints of the accumulated samples, 0 disables them
+        std::vector<std::string> resume_checkpoints = {}; // Checkpoints of this frame, read from the output, to merge and carry on from
+        uint32_t checkpoint_generation = 0; // Numbers this invocation's checkpoints, a re-invoked worker needs a new one to keep the old checkpoints
+        float target_error = 0; // Relative standard error of a pixel's luminance to stop sampling it at, 0 traces exactly samples per pixel
+        uint32_t adaptive_min_samples = 16; // Samples every pixel gets before its error is trusted, when target_error is set
+        uint32_t adaptive_pass_samples = 8; // Samples added at a time to pixels still above target_error
+
+        friend void to_json(nlohmann::json& j, const worker_info& info) {
+            j = nlohmann::json::object();
+            j["scene_info"] = info.scene_info;
+            j["scene_bucket"] = info.scene_bucket;
+            j["scene_root"] = info.scene_root;
+            j["worker_id"] = info.worker_id;
+            j["sqs_queue_arn"] = info.sqs_queue_arn;
+            j["sns_topic_arn"] = info.sns_topic_arn;
+            j["num_workers"] = info.num_workers;
+            j["samples"] = info.samples;
+            j["bounces"] = info.bounces;
+            j["X"] = info.X;
+            j["Y"] = info.Y;
+            j["acceleration"] = info.acceleration;
+            j["mesh_cache_directory"] = info.mesh_cache_directory;
+            j["batch_sizes"] = info.batch_sizes;
+            j["max_in_flight_rays"] = info.max_in_flight_rays;
+            j["tile_size"] = info.tile_size;
+            j["fuse_stages"] = info.fuse_stages;
+            j["worker_rank"] = info.worker_rank;
+            j["transport_directory"] = info.transport_directory;
+            j["ray_compression"] = info.ray_compression;
+            j["preview_interval"] = info.preview_interval;
+            j["preview_samples"] = info.preview_samples;
+            j["output_directory"] = info.output_directory;
+            j["checkpoint_interval"] = info.checkpoint_interval;
+            j["resume_checkpoints"] = info.resume_checkpoints;
+            j["checkpoint_generation"] = info.checkpoint_generation;
+            j["target_error"] = info.target_error;
+            j["adaptive_min_samples"] = info.adaptive_min_samples;
+            j["adaptive_pass_samples"] = info.adaptive_pass_samples;
+        }
+
+        // The baseline fields stay required, a payload missing one throws instead of rendering nothing
+        friend void from_json(const nlohmann::json& j, worker_info& info) {
+            j.at("scene_info").get_to(info.scene_info);
+            j.at("scene_bucket").get_to(info.scene_bucket);
+            j.at("scene_root").get_to(info.scene_root);
+            j.at("worker_id").get_to(info.worker_id);
+            j.at("sqs_queue_arn").get_to(info.sqs_queue_arn);
+            j.at("sns_topic_arn").get_to(info.sns_topic_arn);
+            j.at("num_workers").get_to(info.num_workers);
+            j.at("samples").get_to(info.samples);
+            j.at("bounces").get_to(info.bounces);
+            j.at("X").get_to(info.X);
+            j.at("Y").get_to(info.Y);
+
+            const worker_info defaults{};
+            info.acceleration = j.value("acceleration", defaults.acceleration);
+            info.mesh_cache_directory = j.value("mesh_cache_directory", defaults.mesh_cache_directory);
+            info.batch_sizes = j.value("batch_sizes", defaults.batch_sizes);
+            info.max_in_flight_rays = j.value("max_in_flight_rays", defaults.max_in_flight_rays);
+            info.tile_size = j.value("tile_size", defaults.tile_size);
+            info.fuse_stages = j.value("fuse_stages", defaults.fuse_stages);
+            info.worker_rank = j.value("worker_rank", defaults.worker_rank);
+            info.transport_directory = j.value("transport_directory", defaults.transport_directory);
+            info.ray_compression = j.value("ray_compression", defaults.ray_compression);
+            info.preview_interval = j.value("preview_interval", defaults.preview_interval);
+            info.preview_samples = j.value("preview_samples", defaults.preview_samples);
+            info.output_directory = j.value("output_directory", defaults.output_directory);
+            info.checkpoint_interval = j.value("checkpoint_interval", defaults.checkpoint_interval);
+            info.resume_checkpoints = j.value("resume_checkpoints", defaults.resume_checkpoints);
+            info.checkpoint_generation = j.value("checkpoint_generation", defaults.checkpoint_generation);
+            info.target_error = j.value("target_error", defaults.target_error);
+            info.adaptive_min_samples = j.value("adaptive_min_samples", defaults.adaptive_min_samples);
+            info.adaptive_pass_samples = j.value("adaptive_pass_samples", defaults.adaptive_pass_samples);
+        }
     };
 }
\ No newline at end of file
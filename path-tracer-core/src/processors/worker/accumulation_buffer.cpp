@@ -0,0 +1,77 @@
+#include "accumulation_buffer.hpp"
+#include <path_tracer/math/math.hpp>
+
+namespace processors {
+    accumulation_buffer::accumulation_buffer(math::uvec2 resolution)
+        : m_width(resolution.x), m_pixels(new pixel[static_cast<size_t>(resolution.x) * resolution.y]()) {
+    }
+
+    void accumulation_buffer::add(uint32_t x, uint32_t y, const math::fvec4& sample, bool has_color) {
+        pixel& pixel = m_pixels[static_cast<size_t>(y) * m_width + x];
+
+        if (has_color) {
+            float luminance = get_luminance(math::fvec3(sample));
+
+            increment(pixel.color[0], sample.x);
+            increment(pixel.color[1], sample.y);
+            increment(pixel.color[2], sample.z);
+            increment(pixel.luminance_squared, luminance * luminance);
+            increment(pixel.color_samples, 1U);
+        }
+
+        increment(pixel.alpha, sample.w);
+        increment(pixel.samples, 1U);
+    }
+
+    float accumulation_buffer::get_luminance(const math::fvec3& color) {
+        return math::dot(color, math::fvec3(0.2126F, 0.7152F, 0.0722F));
+    }
+
+    float accumulation_buffer::get_relative_error(const pixel_sum& sum) {
+        if (sum.color_samples < 2) {
+            return std::numeric_limits<float>::infinity();
+        }
+
+        float samples = static_cast<float>(sum.color_samples);
+        float mean = get_luminance(sum.color) / samples;
+        float variance = math::max((sum.luminance_squared - mean * mean * samples) / (samples - 1), 0.0F);
+
+        return math::sqrt(variance / samples) / math::max(mean, relative_error_floor);
+    }
+
+    void accumulation_buffer::load(const std::vector<pixel_sum>& sums) {
+        for (size_t i = 0; i < sums.size(); i++) {
+            pixel& pixel = m_pixels[i];
+
+            pixel.color[0].store(sums[i].color.x, std::memory_order_relaxed);
+            pixel.color[1].store(sums[i].color.y, std::memory_order_relaxed);
+            pixel.color[2].store(sums[i].color.z, std::memory_order_relaxed);
+            pixel.alpha.store(sums[i].alpha, std::memory_order_relaxed);
+            pixel.luminance_squared.store(sums[i].luminance_squared, std::memory_order_relaxed);
+            pixel.samples.store(sums[i].samples, std::memory_order_relaxed);
+            pixel.color_samples.store(sums[i].color_samples, std::memory_order_relaxed);
+        }
+    }
+
+    void accumulation_buffer::merge_into(std::vector<pixel_sum>& sums, const tile& region) const {
+        sums.resize(static_cast<size_t>(region.size.x) * region.size.y);
+
+        for (uint32_t y = 0; y < region.size.y; y++) {
+            const pixel* row = &m_pixels[static_cast<size_t>(region.origin.y + y) * m_width + region.origin.x];
+
+            for (uint32_t x = 0; x < region.size.x; x++) {
+                const pixel& pixel = row[x];
+                pixel_sum& sum = sums[static_cast<size_t>(y) * region.size.x + x];
+
+                sum.color += math::fvec3(
+                    pixel.color[0].load(std::memory_order_relaxed),
+                    pixel.color[1].load(std::memory_order_relaxed),
+                    pixel.color[2].load(std::memory_order_relaxed));
+                sum.alpha += pixel.alpha.load(std::memory_order_relaxed);
+                sum.luminance_squared += pixel.luminance_squared.load(std::memory_order_relaxed);
+                sum.samples += pixel.samples.load(std::memory_order_relaxed);
+                sum.color_samples += pixel.color_samples.load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "pch.hpp"
+#include "tile_grid.hpp"
+#include <path_tracer/math/vec2.hpp>
+#include <path_tracer/math/vec4.hpp>
+#include <atomic>
+
+namespace processors {
+    // Sums of the samples one thread accumulated, flat and row-major. Only the owning thread
+    // adds to it, others may merge it at any time, so the fields are atomics used without RMWs
+    class accumulation_buffer {
+    public:
+        // Merged sums of every buffer, divided only when the image is written
+        struct pixel_sum {
+            math::fvec3 color = math::fvec3::zero;
+            float alpha = 0;
+            float luminance_squared = 0; // Over the color samples, for their variance
+            uint32_t samples = 0;
+            uint32_t color_samples = 0;
+        };
+
+    public:
+        explicit accumulation_buffer(math::uvec2 resolution);
+
+        static float get_luminance(const math::fvec3& color);
+
+        // Standard error of the pixel's mean luminance relative to that mean, infinite below two color samples.
+        // Dark pixels are measured against relative_error_floor so their noise doesn't dominate
+        static float get_relative_error(const pixel_sum& sum);
+
+        // Colors of transparent samples are left out when has_color is false, their alpha still counts
+        void add(uint32_t x, uint32_t y, const math::fvec4& sample, bool has_color);
+
+        // Overwrites the sums of every pixel, only while nothing else uses the buffer
+        void load(const std::vector<pixel_sum>& sums);
+
+        // Adds the pixels of the region to sums, which are laid out row-major over the region
+        void merge_into(std::vector<pixel_sum>& sums, const tile& region) const;
+
+    private:
+        static constexpr float relative_error_floor = 0.01F;
+
+        struct pixel {
+            std::atomic<float> color[3];
+            std::atomic<float> alpha;
+            std::atomic<float> luminance_squared;
+            std::atomic<uint32_t> samples;
+            std::atomic<uint32_t> color_samples;
+        };
+
+        // Plain load and store, the owner is the only writer
+        template <typename T>
+        static void increment(std::atomic<T>& value, T amount) {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+
+    private:
+        uint32_t m_width;
+        std::unique_ptr<pixel[]> m_pixels;
+    };
+}
@@ -2,54 +2,57 @@
 #include <cstdint>
 
 namespace processors {
-    void worker::process_accumulation() {
+    size_t worker::process_accumulation(stage_context& context) {
         using namespace core;
         using namespace math;
 
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_accumulate_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
+        auto& handles = context.handles;
+        auto& retired_slots = context.retired_slots;
+
+        size_t count = m_accumulate_queue.try_dequeue_bulk(context.accumulate_consumer, handles.begin(), m_worker_info.batch_sizes.accumulate);
+        if (count == 0) {
+            return 0;
+        }
 
-            m_completed_rays++;
+        // Rays of a tile arrive mostly together, so their retirements are counted per run
+        uint32_t run_tile = 0;
+        uint32_t run_length = 0;
 
-            uint32_t x = (ray.uuid >> 40) & 0xFFFFF;  
+        for (size_t i = 0; i < count; i++) {
+            const models::cloud_ray& ray = m_rays[handles[i].slot];
+            retired_slots[i] = handles[i].slot;
+
+            uint32_t x = (ray.uuid >> 40) & 0xFFFFF;
             uint32_t y = (ray.uuid >> 20) & 0xFFFFF;
 
             fvec4 data = fvec4(ray.color, ray.alpha);
-        
-            uint32_t sample = pixels[x][y].sample;
-
-            if (transparent_background) {
-                if (data.w > 0.5 && !pixels[x][y].claimed) {
-                  pixels[x][y].color = fvec3(data);
-                  pixels[x][y].alpha = 1 / (sample + 1);
-                  pixels[x][y].claimed = true;
-                  pixels[x][y].sample = sample + 1;
-                  continue;
-                } 
-                else if(data.w < 0.5 && pixels[x][y].claimed) {
-                  pixels[x][y].alpha = pixels[x][y].alpha * sample + data.w;
-                  pixels[x][y].alpha /= sample + 1;
-                  pixels[x][y].sample = sample + 1;
-                  continue;
-                } 
-                else if(data.w < 0.5) {
-                  pixels[x][y].sample = sample + 1;
-                  continue;
-                }
+
+            // With a transparent background only opaque samples give the pixel its color
+            context.accumulation.add(x, y, data, !transparent_background || data.w > 0.5);
+
+            uint32_t tile = m_tiles->get_tile_index(x, y);
+            if (run_length > 0 && tile != run_tile) {
+                retire_tile_rays(run_tile, run_length);
+                run_length = 0;
             }
 
-            pixels[x][y].color = pixels[x][y].color * sample + fvec3(data);
-            pixels[x][y].color /= sample + 1;
+            run_tile = tile;
+            run_length++;
+        }
+
+        retire_tile_rays(run_tile, run_length);
+
+        // The payloads are read, hand the slots back to the generator
+        m_free_slots.enqueue_bulk(context.free_slots, retired_slots.begin(), count);
+        return count;
+    }
 
-            pixels[x][y].alpha = pixels[x][y].alpha * sample + data.w; 
-            pixels[x][y].alpha /= sample + 1;
+    void worker::retire_tile_rays(uint32_t tile, uint32_t count) {
+        m_retired_rays.fetch_add(count, std::memory_order_relaxed);
 
-            pixels[x][y].sample = sample + 1;
+        // Every accumulating thread releases its sums here, so whichever takes the last ray sees them all
+        if (m_tile_remaining_rays[tile].fetch_sub(count, std::memory_order_acq_rel) == count) {
+            finish_tile_pass(tile);
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,137 @@
+#include "checkpoint.hpp"
+#include "cloud/ray_wire.hpp"
+
+namespace processors {
+    namespace checkpoint_format {
+        // magic, version, compression, width, height, payload size
+        static constexpr size_t header_size = 4 + 2 + 2 + 4 + 4 + 4;
+
+        // color, alpha, luminance squared, samples, color samples
+        static constexpr size_t pixel_size = 12 + 4 + 4 + 4 + 4;
+    }
+
+    void checkpoint::merge(const checkpoint& other) {
+        if (pixels.empty()) {
+            *this = other;
+            return;
+        }
+
+        if (other.resolution.x != resolution.x || other.resolution.y != resolution.y) {
+            throw std::runtime_error(fmt::format("Can't merge a {}x{} checkpoint into a {}x{} one",
+                other.resolution.x, other.resolution.y, resolution.x, resolution.y));
+        }
+
+        for (size_t i = 0; i < pixels.size(); i++) {
+            pixels[i].color += other.pixels[i].color;
+            pixels[i].alpha += other.pixels[i].alpha;
+            pixels[i].luminance_squared += other.pixels[i].luminance_squared;
+            pixels[i].samples += other.pixels[i].samples;
+            pixels[i].color_samples += other.pixels[i].color_samples;
+        }
+    }
+
+    std::vector<uint8_t> checkpoint::encode(models::ray_compression compression) const {
+        using namespace checkpoint_format;
+
+        std::vector<uint8_t> records(pixels.size() * pixel_size);
+        cloud::ray_wire::writer writer(records.data());
+
+        for (const auto& pixel : pixels) {
+            writer.put(pixel.color);
+            writer.put(pixel.alpha);
+            writer.put(pixel.luminance_squared);
+            writer.put(pixel.samples);
+            writer.put(pixel.color_samples);
+        }
+
+        std::vector<uint8_t> data(header_size);
+        if (!cloud::ray_wire::compress(records, compression, data)) {
+            compression = models::ray_compression::none;
+            data.insert(data.end(), records.begin(), records.end());
+        }
+
+        cloud::ray_wire::writer header(data.data());
+        header.put(magic);
+        header.put(version);
+        header.put(static_cast<uint16_t>(compression));
+        header.put(resolution.x);
+        header.put(resolution.y);
+        header.put(static_cast<uint32_t>(data.size() - header_size));
+
+        return data;
+    }
+
+    checkpoint checkpoint::decode(std::span<const uint8_t> data) {
+        using namespace checkpoint_format;
+
+        if (data.size() < header_size) {
+            throw std::runtime_error("Checkpoint is too small for its header");
+        }
+
+        cloud::ray_wire::reader header(data.data());
+        if (header.get<uint32_t>() != magic) {
+            throw std::runtime_error("Not a checkpoint");
+        }
+
+        if (header.get<uint16_t>() != version) {
+            throw std::runtime_error("Checkpoint has an unsupported version");
+        }
+
+        auto compression = static_cast<models::ray_compression>(header.get<uint16_t>());
+        if (compression != models::ray_compression::none && compression != models::ray_compression::lz4) {
+            throw std::runtime_error("Checkpoint uses an unknown compression");
+        }
+
+        checkpoint checkpoint;
+        checkpoint.resolution.x = header.get<uint32_t>();
+        checkpoint.resolution.y = header.get<uint32_t>();
+
+        uint32_t payload_size = header.get<uint32_t>();
+        if (payload_size != data.size() - header_size) {
+            throw std::runtime_error("Checkpoint size doesn't match its header");
+        }
+
+        // Checked before multiplying by the pixel size, which could wrap around for a corrupt resolution
+        size_t pixel_count = static_cast<size_t>(checkpoint.resolution.x) * checkpoint.resolution.y;
+        if (pixel_count > cloud::ray_wire::max_records_size / pixel_size) {
+            throw std::runtime_error("Checkpoint is too large to decode");
+        }
+
+        size_t records_size = pixel_count * pixel_size;
+
+        auto payload = data.subspan(header_size);
+
+        // Uncompressed records are read in place
+        std::vector<uint8_t> scratch;
+        const uint8_t* records = payload.data();
+
+        if (compression == models::ray_compression::none) {
+            if (payload.size() != records_size) {
+                throw std::runtime_error("Checkpoint size doesn't match its resolution");
+            }
+        }
+        else {
+            // Like ray batches, LZ4 can't have expanded the payload more than 255 times
+            if (records_size / 256 > payload.size()) {
+                throw std::runtime_error("Checkpoint resolution doesn't fit its compressed size");
+            }
+
+            scratch.resize(records_size);
+            cloud::ray_wire::decompress(payload, compression, scratch);
+            records = scratch.data();
+        }
+
+        checkpoint.pixels.resize(records_size / pixel_size);
+        cloud::ray_wire::reader reader(records);
+
+        for (auto& pixel : checkpoint.pixels) {
+            pixel.color = reader.get_fvec3();
+            pixel.alpha = reader.get<float>();
+            pixel.luminance_squared = reader.get<float>();
+            pixel.samples = reader.get<uint32_t>();
+            pixel.color_samples = reader.get<uint32_t>();
+        }
+
+        return checkpoint;
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "pch.hpp"
+#include "accumulation_buffer.hpp"
+#include "models/ray_message.hpp"
+#include <span>
+
+namespace processors {
+    // Sums accumulated for one frame, enough for a later invocation to carry on rendering it.
+    // The renderer draws fresh random numbers every run, so the sample counts are all it needs to continue
+    struct checkpoint {
+        static constexpr uint32_t magic = 0x4B435450; // "PTCK"
+        static constexpr uint16_t version = 2;
+
+        math::uvec2 resolution = math::uvec2(0, 0);
+        std::vector<accumulation_buffer::pixel_sum> pixels; // Row-major
+
+        // Adds the sums of another checkpoint of the same frame, such as one from a render that ran alongside.
+        // Workers only checkpoint the samples they traced themselves, each invocation under its own checkpoint_generation,
+        // so a frame is the merge of the latest checkpoint of every invocation in a resume chain
+        void merge(const checkpoint& other);
+
+        std::vector<uint8_t> encode(models::ray_compression compression) const;
+
+        // Throws if data isn't a checkpoint this version can read
+        static checkpoint decode(std::span<const uint8_t> data);
+    };
+}
@@ -0,0 +1,37 @@
+#include "models/cloud_ray.hpp"
+#include "worker.hpp"
+
+namespace processors {
+    size_t worker::process_fused(stage_context& context) {
+        auto& handles = context.handles;
+        auto& router = context.router;
+
+        size_t count = m_object_intersection_queue.try_dequeue_bulk(context.object_intersection_consumer, handles.begin(), m_worker_info.batch_sizes.object_intersection);
+
+        for (size_t i = 0; i < count; i++) {
+            models::ray_handle& handle = handles[i];
+            models::cloud_ray& ray = m_rays[handle.slot];
+
+            // With nobody to merge with, the full intersection is the nearest hit
+            auto result = m_scene.intersect(ray.ray);
+
+            ray.surface = {};
+            ray.direct_light_ray = {};
+            ray.direct_light_occluded = false;
+
+            if (result.hit) {
+                ray.surface = result.get_surface();
+                ray.direct_light_ray = sample_direct_light_ray(ray.surface->position, ray.surface->normal);
+
+                if (ray.direct_light_ray.has_value()) {
+                    ray.direct_light_occluded = m_scene.occluded(ray.direct_light_ray.value());
+                }
+            }
+
+            shade(handle, ray, router);
+        }
+
+        router.flush();
+        return count;
+    }
+}
@@ -7,142 +7,158 @@
 #include <thread>
 
 namespace processors {
-    void worker::process_object_intersections() {
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_object_intersection_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
+    size_t worker::process_object_intersections(stage_context& context) {
+        auto& handles = context.handles;
+        auto& slots = context.slots;
 
-            auto result = m_scene.intersect_min_result(ray.ray);
-            ray.object_intersect_distance = result.distance;
-
-            if (result.hit) {
-                auto sun_light = m_scene.m_sun_light;
-                if (sun_light) {
-                    fvec3 direct_incoming = sun_light->get_global_transform().basis * fvec3::backward;
-			        direct_incoming = util::rand_cone_vec(core::rand(), math::cos(core::rand() * sun_light->get_component<scene::sun_light>()->angular_radius),
-			                                      direct_incoming);
-
-                    geometry::ray direct_ray(
-                        result.position + direct_incoming * math::epsilon,
-                        direct_incoming);
-
-                    if (math::dot(result.normal, direct_incoming) > 0) {
-                        ray.direct_light_ray = direct_ray;
-                    }
-                    else {
-                        ray.direct_light_ray = {};
-                    }
-                }
-            }
+        size_t count = m_object_intersection_queue.try_dequeue_bulk(context.object_intersection_consumer, handles.begin(), m_worker_info.batch_sizes.object_intersection);
+        if(count == 0) {
+            return 0;
+        }
 
-            // Add entry to ray in intersection map here. SQS, on rare occassions, messages are delivered "at least once". Have to create an idempotent system.
-            // By adding to the map here, can remove the check in the results method. If results worker gets an id not in map, just drop it.
+        for (size_t i = 0; i < count; i++) {
+            models::cloud_ray& ray = m_rays[handles[i].slot];
+            ray.surface = {};
+            ray.hit_distance = std::numeric_limits<float>::max();
+            ray.shard_walk = {};
 
-            m_object_intersection_result_queue.enqueue(ray);
+            slots[i] = handles[i].slot;
         }
+
+        walk_object_intersections(std::span<const uint32_t>(slots.data(), count), context.shards, context.router);
+
+        context.router.flush();
+        return count;
     }
 
-    void worker::process_direct_lighting_intersections() {
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_direct_lighting_intersection_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
+    size_t worker::process_direct_lighting_intersections(stage_context& context) {
+        auto& handles = context.handles;
+        auto& slots = context.slots;
 
-            bool hit = false;
-            if (ray.direct_light_ray.has_value()) {
-                auto result = m_scene.intersect(ray.direct_light_ray.value());
-                hit = result.hit;
-            }
+        size_t count = m_direct_lighting_intersection_queue.try_dequeue_bulk(context.direct_lighting_intersection_consumer, handles.begin(), m_worker_info.batch_sizes.direct_lighting_intersection);
+        if (count == 0) {
+            return 0;
+        }
 
-            ray.direct_light_intersect_result = hit;
-            m_direct_lighting_intersection_result_queue.enqueue(ray);
+        for (size_t i = 0; i < count; i++) {
+            models::cloud_ray& ray = m_rays[handles[i].slot];
+            ray.direct_light_occluded = false;
+            ray.shard_walk = {};
+
+            slots[i] = handles[i].slot;
         }
+
+        walk_direct_lighting_intersections(std::span<const uint32_t>(slots.data(), count), context.shards, context.router);
+
+        context.router.flush();
+        return count;
     }
 
-    void worker::process_object_intersection_results() {
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_object_intersection_result_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
+    worker::shard_queries::shard_queries(uint32_t num_workers) : queries(num_workers) {
+    }
+
+    void worker::walk_object_intersections(std::span<const uint32_t> slots, shard_queries& shards, ray_router& router) {
+        auto& local_queries = shards.queries[m_worker_info.worker_rank];
+
+        // A ray visits each shard once, so after our own shard it only goes to other workers
+        auto advance = [&](uint32_t slot) {
+            models::cloud_ray& ray = m_rays[slot];
+
+            if (auto shard = m_shards->next(ray.ray, ray.hit_distance, ray.shard_walk)) {
+                shards.queries[*shard].push_back({slot, ray.ray});
+                return;
             }
 
-            if(!m_object_intersection_results.contains(ray.uuid)) {
-                m_object_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{1, ray};
+            // Sample the sun from the nearest hit only
+            ray.direct_light_ray = {};
+            if (ray.surface.has_value()) {
+                ray.direct_light_ray = sample_direct_light_ray(ray.surface->position, ray.surface->normal);
             }
 
-            auto results = m_object_intersection_results[ray.uuid];
-            if(results.first < m_worker_info.num_workers) {
-                auto previous_best = results.second;
-                if (ray.object_intersect_distance < previous_best.object_intersect_distance) {
-                    m_object_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{results.first + 1, ray};
-                }
-                else {
-                    m_object_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{results.first + 1, previous_best};
-                }
+            router.push({slot}, ray.direct_light_ray.has_value() ? models::ray_stage::DIRECT_LIGHTING : models::ray_stage::SHADING);
+        };
+
+        for (uint32_t slot : slots) {
+            advance(slot);
+        }
+
+        if (!local_queries.empty()) {
+            shards.geometry_rays.resize(local_queries.size());
+            shards.results.resize(local_queries.size());
+
+            for (size_t i = 0; i < local_queries.size(); i++) {
+                shards.geometry_rays[i] = local_queries[i].ray;
             }
-            
-            results = m_object_intersection_results[ray.uuid];
-            if (results.first == m_worker_info.num_workers) {
-                m_object_intersection_results.erase(ray.uuid);
-                
-                auto best_ray = results.second;
-                if (best_ray.object_intersect_distance == std::numeric_limits<float>::max()) {
-                    best_ray.stage = models::ray_stage::SHADING;
-                }
-                else {
-                    if (best_ray.direct_light_ray.has_value()) {
-                        best_ray.stage = models::ray_stage::DIRECT_LIGHTING;
-                    }
-                    else {
-                        best_ray.stage = models::ray_stage::SHADING;
-                    }
-                }
-                map_ray_stage_to_queue(best_ray);
+
+            m_scene.intersect_batch(shards.geometry_rays, shards.results);
+
+            for (size_t i = 0; i < local_queries.size(); i++) {
+                apply_object_intersection(local_queries[i].slot, shards.results[i]);
+                advance(local_queries[i].slot);
             }
+
+            local_queries.clear();
         }
+
+        send_queries(models::message_type::intersect, shards);
     }
 
-    void worker::process_direct_lighting_intersection_results() {
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_direct_lighting_intersection_result_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
+    void worker::walk_direct_lighting_intersections(std::span<const uint32_t> slots, shard_queries& shards, ray_router& router) {
+        auto& local_queries = shards.queries[m_worker_info.worker_rank];
 
-            if(!m_direct_lighting_intersection_results.contains(ray.uuid)) {
-                m_direct_lighting_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{1, ray};
-            }
+        // Any occluder will do, so the walk ends at the first shard that has one
+        auto advance = [&](uint32_t slot) {
+            models::cloud_ray& ray = m_rays[slot];
 
-            auto results = m_direct_lighting_intersection_results[ray.uuid];
-            if (results.first < m_worker_info.num_workers) {
-                auto previous = results.second;
-                if (ray.direct_light_intersect_result) {
-                    m_direct_lighting_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{results.first + 1, ray};
-                }
-                else {
-                    m_direct_lighting_intersection_results[ray.uuid] = std::pair<int, models::cloud_ray>{results.first + 1, previous};
+            if (!ray.direct_light_occluded) {
+                if (auto shard = m_shards->next(ray.direct_light_ray.value(), std::numeric_limits<float>::max(), ray.shard_walk)) {
+                    shards.queries[*shard].push_back({slot, ray.direct_light_ray.value()});
+                    return;
                 }
             }
-            
-            results = m_direct_lighting_intersection_results[ray.uuid];
-            if (results.first == m_worker_info.num_workers) {
-                m_direct_lighting_intersection_results.erase(ray.uuid);
-                
-                auto best_ray = results.second;
-                best_ray.stage = models::ray_stage::SHADING;
-                map_ray_stage_to_queue(best_ray);
+
+            router.push({slot}, models::ray_stage::SHADING);
+        };
+
+        for (uint32_t slot : slots) {
+            advance(slot);
+        }
+
+        if (!local_queries.empty()) {
+            for (const auto& query : local_queries) {
+                m_rays[query.slot].direct_light_occluded = m_scene.occluded(query.ray);
+                advance(query.slot);
             }
+
+            local_queries.clear();
         }
+
+        send_queries(models::message_type::occluded, shards);
+    }
+
+    void worker::apply_object_intersection(uint32_t slot, const models::intersect_result_min& result) {
+        models::cloud_ray& ray = m_rays[slot];
+
+        if (result.hit && result.distance < ray.hit_distance) {
+            ray.hit_distance = result.distance;
+            ray.surface = result.surface;
+        }
+    }
+
+    std::optional<geometry::ray> worker::sample_direct_light_ray(const fvec3& position, const fvec3& normal) const {
+        auto sun_light = m_scene.m_sun_light;
+        if (!sun_light) {
+            return {};
+        }
+
+        fvec3 direct_incoming = sun_light->get_global_transform().basis * fvec3::backward;
+        direct_incoming = util::rand_cone_vec(core::rand(), math::cos(core::rand() * sun_light->get_component<scene::sun_light>()->angular_radius),
+                                      direct_incoming);
+
+        if (math::dot(normal, direct_incoming) <= 0) {
+            return {};
+        }
+
+        return geometry::ray(position + direct_incoming * math::epsilon, direct_incoming);
     }
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include "cloud/ray_wire.hpp"
+#include "models/cloud_ray.hpp"
+#include "models/ray_message.hpp"
+#include "worker.hpp"
+
+namespace processors {
+    void worker::send_queries(models::message_type type, shard_queries& shards) {
+        std::vector<uint8_t> frame;
+
+        for (uint32_t shard = 0; shard < shards.queries.size(); shard++) {
+            auto& queries = shards.queries[shard];
+            if (queries.empty()) {
+                continue;
+            }
+
+            cloud::ray_wire::encode(type, m_worker_info.worker_rank, std::span<const models::ray_query>(queries), m_worker_info.ray_compression, frame);
+            m_transport->send_rays(shard, frame);
+            queries.clear();
+        }
+    }
+
+    void worker::receive_remote_results() {
+        ray_router router(*this);
+        shard_queries shards(m_worker_info.num_workers);
+
+        std::vector<uint8_t> frame;
+        std::vector<uint8_t> scratch;
+        std::vector<uint32_t> slots;
+
+        while (!m_should_terminate) {
+            if (!m_transport->recv_rays(frame, queue_wait_timeout)) {
+                for (uint32_t peer = 1; peer < static_cast<uint32_t>(m_worker_info.num_workers); peer++) {
+                    if (!m_transport->is_connected(peer)) {
+                        fail_remote(fmt::format("worker {} disconnected", peer));
+                        break;
+                    }
+                }
+
+                continue;
+            }
+
+            try {
+                auto header = cloud::ray_wire::read_header(frame);
+                slots.clear();
+
+                switch (static_cast<models::message_type>(header.type)) {
+                    case models::message_type::intersect_result:
+                        for (const auto& reply : cloud::ray_wire::decode<models::intersect_reply>(frame, scratch)) {
+                            if (reply.slot >= m_rays.size()) {
+                                throw std::runtime_error("Result for a ray slot that doesn't exist");
+                            }
+
+                            apply_object_intersection(reply.slot, reply.result);
+                            slots.push_back(reply.slot);
+                        }
+
+                        walk_object_intersections(slots, shards, router);
+                        break;
+                    case models::message_type::occluded_result:
+                        for (const auto& reply : cloud::ray_wire::decode<models::occluded_reply>(frame, scratch)) {
+                            if (reply.slot >= m_rays.size()) {
+                                throw std::runtime_error("Result for a ray slot that doesn't exist");
+                            }
+
+                            m_rays[reply.slot].direct_light_occluded = reply.occluded;
+                            slots.push_back(reply.slot);
+                        }
+
+                        walk_direct_lighting_intersections(slots, shards, router);
+                        break;
+                    default:
+                        spdlog::warn("Worker 0 ignoring unexpected message from worker {}", header.source);
+                        break;
+                }
+            }
+            catch (const std::exception& e) {
+                fail_remote(fmt::format("failed to read results: {}", e.what()));
+                break;
+            }
+
+            router.flush();
+        }
+    }
+
+    void worker::publish_shard_bounds() {
+        geometry::aabb bounds = m_scene.get_bounds();
+
+        std::vector<uint8_t> frame;
+        cloud::ray_wire::encode(models::message_type::shard_bounds, m_worker_info.worker_rank, std::span<const geometry::aabb>(&bounds, 1), models::ray_compression::none, frame);
+        m_transport->send_rays(0, frame);
+    }
+
+    std::vector<geometry::aabb> worker::gather_shard_bounds() {
+        std::vector<geometry::aabb> bounds(m_worker_info.num_workers, cloud::shard_map::get_empty_bounds());
+        bounds[0] = m_scene.get_bounds();
+
+        std::vector<uint8_t> frame;
+        std::vector<uint8_t> scratch;
+
+        // Every other worker publishes its bounds right after connecting
+        for (int received = 1; received < m_worker_info.num_workers;) {
+            if (!m_transport->recv_rays(frame, queue_wait_timeout)) {
+                for (uint32_t peer = 1; peer < static_cast<uint32_t>(m_worker_info.num_workers); peer++) {
+                    if (!m_transport->is_connected(peer)) {
+                        throw std::runtime_error(fmt::format("Worker {} disconnected before sending its shard bounds", peer));
+                    }
+                }
+
+                continue;
+            }
+
+            auto header = cloud::ray_wire::read_header(frame);
+            if (static_cast<models::message_type>(header.type) != models::message_type::shard_bounds || header.source >= bounds.size()) {
+                throw std::runtime_error("Expected shard bounds from every worker before rendering");
+            }
+
+            auto records = cloud::ray_wire::decode<geometry::aabb>(frame, scratch);
+            if (records.size() != 1) {
+                throw std::runtime_error("Shard bounds message should hold one aabb");
+            }
+
+            bounds[header.source] = records[0];
+            received++;
+        }
+
+        return bounds;
+    }
+
+    void worker::serve_remote_queries() {
+        std::vector<uint8_t> frame;
+        std::vector<uint8_t> scratch;
+
+        std::vector<geometry::ray> geometry_rays;
+        std::vector<models::intersect_result_min> results;
+        std::vector<models::intersect_reply> intersect_replies;
+        std::vector<models::occluded_reply> occluded_replies;
+
+        while (!m_should_terminate) {
+            if (!m_transport->recv_rays(frame, queue_wait_timeout)) {
+                // Nothing more comes from a worker 0 that went away, the shutdown included
+                if (!m_transport->is_connected(0) && !m_should_terminate) {
+                    fail_remote("worker 0 disconnected before shutting this worker down");
+                }
+
+                continue;
+            }
+
+            try {
+                auto header = cloud::ray_wire::read_header(frame);
+
+                switch (static_cast<models::message_type>(header.type)) {
+                    case models::message_type::intersect: {
+                        auto queries = cloud::ray_wire::decode<models::ray_query>(frame, scratch);
+
+                        geometry_rays.resize(queries.size());
+                        results.resize(queries.size());
+                        intersect_replies.resize(queries.size());
+
+                        for (size_t i = 0; i < queries.size(); i++) {
+                            const auto query = queries[i];
+                            geometry_rays[i] = query.ray;
+                            intersect_replies[i].slot = query.slot;
+                        }
+
+                        m_scene.intersect_batch(geometry_rays, results);
+
+                        for (size_t i = 0; i < queries.size(); i++) {
+                            intersect_replies[i].result = results[i];
+                        }
+
+                        cloud::ray_wire::encode(models::message_type::intersect_result, m_worker_info.worker_rank,
+                            std::span<const models::intersect_reply>(intersect_replies), m_worker_info.ray_compression, frame);
+                        m_transport->send_rays(header.source, frame);
+                        break;
+                    }
+                    case models::message_type::occluded: {
+                        auto queries = cloud::ray_wire::decode<models::ray_query>(frame, scratch);
+
+                        occluded_replies.resize(queries.size());
+                        for (size_t i = 0; i < queries.size(); i++) {
+                            const auto query = queries[i];
+                            occluded_replies[i] = {query.slot, m_scene.occluded(query.ray)};
+                        }
+
+                        cloud::ray_wire::encode(models::message_type::occluded_result, m_worker_info.worker_rank,
+                            std::span<const models::occluded_reply>(occluded_replies), m_worker_info.ray_compression, frame);
+                        m_transport->send_rays(header.source, frame);
+                        break;
+                    }
+                    case models::message_type::shutdown:
+                        m_should_terminate = true;
+                        break;
+                    default:
+                        spdlog::warn("Worker {} ignoring unexpected message from worker {}", m_worker_info.worker_rank, header.source);
+                        break;
+                }
+            }
+            catch (const std::exception& e) {
+                fail_remote(fmt::format("failed to answer queries: {}", e.what()));
+            }
+        }
+    }
+
+    void worker::fail_remote(const std::string& reason) {
+        spdlog::error("Worker {} stopping the render: {}", m_worker_info.worker_rank, reason);
+
+        m_remote_failed = true;
+        m_should_terminate = true;
+        m_stage_epoch++;
+        m_stage_epoch.notify_all();
+    }
+}
\ No newline at end of file
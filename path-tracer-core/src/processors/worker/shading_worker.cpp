@@ -7,196 +7,194 @@
 
 namespace processors {
 
-    void worker::process_shading() {
+    size_t worker::process_shading(stage_context& context) {
+        auto& handles = context.handles;
+        auto& router = context.router;
+
+        size_t count = m_shading_queue.try_dequeue_bulk(context.shading_consumer, handles.begin(), m_worker_info.batch_sizes.shading);
+
+        for (size_t i = 0; i < count; i++) {
+            shade(handles[i], m_rays[handles[i].slot], router);
+        }
+
+        router.flush();
+        return count;
+    }
+
+    void worker::shade(const models::ray_handle& handle, models::cloud_ray& ray, ray_router& router) {
         using namespace math;
         using namespace core;
 
-        while (!m_should_terminate) {
-            models::cloud_ray ray{};
-            if(!m_shading_queue.try_dequeue(ray)) {
-                std::this_thread::yield();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
+        geometry::ray& current_ray = ray.ray;
+        fvec3& accumulated_color = ray.color;
+        fvec3& throughput = ray.scale;
+        float& alpha = ray.alpha;
+
+        if (!ray.surface.has_value()) {
+            if (m_scene.m_environment) {
+                fvec3 env_color = fvec3(m_scene.m_environment->sample(
+                    core::equirectangular_proj(current_ray.get_dir()))) * environment_factor;
+                accumulated_color += throughput * env_color;
+            } else {
+                accumulated_color += throughput * environment_factor;
             }
+            alpha = transparent_background ? 0.0f : 1.0f;
+        
+            router.push(handle, models::ray_stage::ACCUMULATE);
+            return;
+        }
 
-            geometry::ray& current_ray = ray.ray;
-            fvec3& accumulated_color = ray.color;
-            fvec3& throughput = ray.scale;
-            float& alpha = ray.alpha;
-
-            auto result = m_scene.intersect(current_ray);
-            if (!result.hit) {
-                if (m_scene.m_environment) {
-                    fvec3 env_color = fvec3(m_scene.m_environment->sample(
-                        core::equirectangular_proj(current_ray.get_dir()))) * environment_factor;
-                    accumulated_color += throughput * env_color;
-                } else {
-                    accumulated_color += throughput * environment_factor;
-                }
-                alpha = transparent_background ? 0.0f : 1.0f;
-                
-                ray.stage = models::ray_stage::ACCUMULATE;
-                map_ray_stage_to_queue(ray);
-                continue;
-            }
-
-            alpha = 1.0f;
-
-            fvec3 albedo = result.material->get_albedo(result.tex_coord);
-            float opacity = result.material->get_opacity(result.tex_coord);
-            float roughness = result.material->get_roughness(result.tex_coord);
-            float metallic = result.material->get_metallic(result.tex_coord);
-            fvec3 emissive = result.material->get_emissive(result.tex_coord) * 10;
-            float ior = result.material->ior;
+        alpha = 1.0f;
 
-            accumulated_color += throughput * emissive;
+        const models::surface& surface = ray.surface.value();
 
-            if (!math::is_approx(opacity, 1) && core::rand() > opacity) {
-                current_ray = geometry::ray(
-                    result.position + current_ray.get_dir() * math::epsilon,
-                    current_ray.get_dir()
-                );
+        fvec3 albedo = surface.albedo;
+        float opacity = surface.opacity;
+        float roughness = surface.roughness;
+        float metallic = surface.metallic;
+        fvec3 emissive = surface.emissive * 10;
+        float ior = surface.ior;
 
-                ray.stage = models::ray_stage::INTERSECT;
-                map_ray_stage_to_queue(ray);
-                continue; 
-            }
+        accumulated_color += throughput * emissive;
 
-            fvec3 normal = result.get_normal();
-            fvec3 outcoming = -current_ray.get_dir();
+        if (!math::is_approx(opacity, 1) && core::rand() > opacity) {
+            current_ray = geometry::ray(
+                surface.position + current_ray.get_dir() * math::epsilon,
+                current_ray.get_dir()
+            );
 
-            if (math::dot(normal, outcoming) <= 0) {
-                ray.stage = models::ray_stage::ACCUMULATE;
-                map_ray_stage_to_queue(ray);
-                continue;
-            }
+            router.push(handle, models::ray_stage::INTERSECT);
+            return; 
+        }
 
-            if (result.material->shadow_catcher && ray.bounce == bounce_count) {
-                bool in_shadow = true;
-               
-                if (m_scene.m_sun_light && ray.direct_light_ray.has_value()) {
-                    fvec3 direct_incoming = ray.direct_light_ray.value().get_dir();
-                    
-                    if (math::dot(normal, direct_incoming) > 0) {
-                        
-                        auto shadow_result = ray.direct_light_intersect_result;
-
-                        if (!shadow_result) {
-                            in_shadow = false;
-                        }
-                    }
-                }
-                if (in_shadow) {
-                    ray.color = fvec3::zero;
-                    ray.alpha = 1;
-                    ray.stage = models::ray_stage::ACCUMULATE;
-                    map_ray_stage_to_queue(ray);
-                    continue;
-                } else {
-                    current_ray = geometry::ray(
-                        result.position + current_ray.get_dir() * math::epsilon,
-                        current_ray.get_dir()
-                    );
-
-                    ray.stage = models::ray_stage::INTERSECT;
-                    map_ray_stage_to_queue(ray);
-                    continue;
-                }
-            }
+        fvec3 normal = surface.normal;
+        fvec3 outcoming = -current_ray.get_dir();
 
-            roughness = math::max(roughness, 0.05F);
-            float specular_probability = core::pbr::fresnel(outcoming, reflect(-outcoming, normal), ior);
-            specular_probability = math::max(specular_probability, metallic);
-            bool specular_sample = core::rand() < specular_probability;
+        if (math::dot(normal, outcoming) <= 0) {
+            router.push(handle, models::ray_stage::ACCUMULATE);
+            return;
+        }
 
+        if (surface.shadow_catcher && ray.bounce == bounce_count) {
+            bool in_shadow = true;
+       
             if (m_scene.m_sun_light && ray.direct_light_ray.has_value()) {
                 fvec3 direct_incoming = ray.direct_light_ray.value().get_dir();
-
+            
                 if (math::dot(normal, direct_incoming) > 0) {
-                    auto direct_result = ray.direct_light_intersect_result;
-                    
-                    if (!direct_result) {
-                        float diffuse_pdf = pbr::pdf_diffuse(normal, direct_incoming);
-                        fvec3 diffuse_brdf = diffuse_pdf * albedo;
-                        
-                        float specular_pdf = pbr::pdf_specular(normal, outcoming, direct_incoming, roughness);
-                        fvec3 specular_brdf(specular_pdf);
-                        
-                        fvec3 fresnel = lerp(fvec3(0.04F), albedo, metallic);
-                        {
-                            fvec3 halfway = normalize(outcoming + direct_incoming);
-                            float cos_theta = dot(outcoming, halfway);
-                            fresnel = lerp(fresnel, fvec3::one, math::pow(1 - cos_theta, 5));
-                        }
-                        
-                        diffuse_brdf = lerp(diffuse_brdf, fvec3::zero, metallic);
-                        fvec3 brdf = lerp(diffuse_brdf, specular_brdf, fresnel);
-                        
-                        diffuse_pdf = 1;
-                        specular_pdf = 1;
-                        float pdf = lerp(diffuse_pdf, specular_pdf, specular_probability);
-                        
-                        fvec3 direct_in = m_scene.m_sun_light->get_component<scene::sun_light>()->energy;
-                        fvec3 direct_out = brdf * direct_in / math::max(pdf, math::epsilon);
-                        direct_out = math::clamp(direct_out, fvec3::zero, direct_in);
-                        
-                        accumulated_color += throughput * direct_out;
+                
+                    auto shadow_result = ray.direct_light_occluded;
+
+                    if (!shadow_result) {
+                        in_shadow = false;
                     }
                 }
-            
             }
+            if (in_shadow) {
+                ray.color = fvec3::zero;
+                ray.alpha = 1;
+                router.push(handle, models::ray_stage::ACCUMULATE);
+                return;
+            } else {
+                current_ray = geometry::ray(
+                    surface.position + current_ray.get_dir() * math::epsilon,
+                    current_ray.get_dir()
+                );
+
+                router.push(handle, models::ray_stage::INTERSECT);
+                return;
+            }
+        }
+
+        roughness = math::max(roughness, 0.05F);
+        float specular_probability = core::pbr::fresnel(outcoming, reflect(-outcoming, normal), ior);
+        specular_probability = math::max(specular_probability, metallic);
+        bool specular_sample = core::rand() < specular_probability;
+
+        if (m_scene.m_sun_light && ray.direct_light_ray.has_value()) {
+            fvec3 direct_incoming = ray.direct_light_ray.value().get_dir();
 
-            fvec2 rand_val(core::rand(), core::rand());
-            fvec3 indirect_incoming = specular_sample
-                ? pbr::importance_specular(rand_val, normal, outcoming, roughness)
-                : pbr::importance_diffuse(rand_val, normal, outcoming);
+            if (math::dot(normal, direct_incoming) > 0) {
+                auto direct_result = ray.direct_light_occluded;
             
-            if (math::dot(normal, indirect_incoming) > 0) {
-                float diffuse_pdf = pbr::pdf_diffuse(normal, indirect_incoming);
-                fvec3 diffuse_brdf = diffuse_pdf * albedo;
+                if (!direct_result) {
+                    float diffuse_pdf = pbr::pdf_diffuse(normal, direct_incoming);
+                    fvec3 diffuse_brdf = diffuse_pdf * albedo;
                 
-                float specular_pdf = pbr::pdf_specular(normal, outcoming, indirect_incoming, roughness);
-                fvec3 specular_brdf(specular_pdf);
+                    float specular_pdf = pbr::pdf_specular(normal, outcoming, direct_incoming, roughness);
+                    fvec3 specular_brdf(specular_pdf);
                 
-                fvec3 fresnel = lerp(fvec3(0.04F), albedo, metallic);
-                {
-                    fvec3 halfway = normalize(outcoming + indirect_incoming);
-                    float cos_theta = dot(outcoming, halfway);
-                    fresnel = lerp(fresnel, fvec3::one, math::pow(1 - cos_theta, 5));
-                }
-                
-                diffuse_brdf = lerp(diffuse_brdf, fvec3::zero, metallic);
-                fvec3 brdf = lerp(diffuse_brdf, specular_brdf, fresnel);
+                    fvec3 fresnel = lerp(fvec3(0.04F), albedo, metallic);
+                    {
+                        fvec3 halfway = normalize(outcoming + direct_incoming);
+                        float cos_theta = dot(outcoming, halfway);
+                        fresnel = lerp(fresnel, fvec3::one, math::pow(1 - cos_theta, 5));
+                    }
                 
-                float pdf = lerp(diffuse_pdf, specular_pdf, specular_probability);
+                    diffuse_brdf = lerp(diffuse_brdf, fvec3::zero, metallic);
+                    fvec3 brdf = lerp(diffuse_brdf, specular_brdf, fresnel);
                 
-                throughput *= brdf / math::max(pdf, math::epsilon);
+                    diffuse_pdf = 1;
+                    specular_pdf = 1;
+                    float pdf = lerp(diffuse_pdf, specular_pdf, specular_probability);
                 
-                throughput = math::clamp(throughput, fvec3::zero, fvec3(10.0f));
+                    fvec3 direct_in = m_scene.m_sun_light->get_component<scene::sun_light>()->energy;
+                    fvec3 direct_out = brdf * direct_in / math::max(pdf, math::epsilon);
+                    direct_out = math::clamp(direct_out, fvec3::zero, direct_in);
                 
-                current_ray = geometry::ray(
-                    result.position + indirect_incoming * math::epsilon,
-                    indirect_incoming
-                );
-
-                if (ray.bounce < bounce_count - 2) {
-                    float p = math::max(throughput.x, math::max(throughput.y, throughput.z));
-                    if (core::rand() > p) {
-                        ray.stage = models::ray_stage::ACCUMULATE;
-                        map_ray_stage_to_queue(ray);
-                        continue;
-                    }
-                    throughput /= p; // Compensate for termination
+                    accumulated_color += throughput * direct_out;
                 }
+            }
+    
+        }
 
-                ray.bounce -= 1;
-                ray.stage = ray.bounce > 0 ? models::ray_stage::INTERSECT : models::ray_stage::ACCUMULATE;
-                map_ray_stage_to_queue(ray);
+        fvec2 rand_val(core::rand(), core::rand());
+        fvec3 indirect_incoming = specular_sample
+            ? pbr::importance_specular(rand_val, normal, outcoming, roughness)
+            : pbr::importance_diffuse(rand_val, normal, outcoming);
+    
+        if (math::dot(normal, indirect_incoming) > 0) {
+            float diffuse_pdf = pbr::pdf_diffuse(normal, indirect_incoming);
+            fvec3 diffuse_brdf = diffuse_pdf * albedo;
+        
+            float specular_pdf = pbr::pdf_specular(normal, outcoming, indirect_incoming, roughness);
+            fvec3 specular_brdf(specular_pdf);
+        
+            fvec3 fresnel = lerp(fvec3(0.04F), albedo, metallic);
+            {
+                fvec3 halfway = normalize(outcoming + indirect_incoming);
+                float cos_theta = dot(outcoming, halfway);
+                fresnel = lerp(fresnel, fvec3::one, math::pow(1 - cos_theta, 5));
             }
-            else {
-                ray.stage = models::ray_stage::ACCUMULATE;
-                map_ray_stage_to_queue(ray);
+        
+            diffuse_brdf = lerp(diffuse_brdf, fvec3::zero, metallic);
+            fvec3 brdf = lerp(diffuse_brdf, specular_brdf, fresnel);
+        
+            float pdf = lerp(diffuse_pdf, specular_pdf, specular_probability);
+        
+            throughput *= brdf / math::max(pdf, math::epsilon);
+        
+            throughput = math::clamp(throughput, fvec3::zero, fvec3(10.0f));
+        
+            current_ray = geometry::ray(
+                surface.position + indirect_incoming * math::epsilon,
+                indirect_incoming
+            );
+
+            if (ray.bounce < bounce_count - 2) {
+                float p = math::max(throughput.x, math::max(throughput.y, throughput.z));
+                if (core::rand() > p) {
+                    router.push(handle, models::ray_stage::ACCUMULATE);
+                    return;
+                }
+                throughput /= p; // Compensate for termination
             }
+
+            ray.bounce -= 1;
+            router.push(handle, ray.bounce > 0 ? models::ray_stage::INTERSECT : models::ray_stage::ACCUMULATE);
+        }
+        else {
+            router.push(handle, models::ray_stage::ACCUMULATE);
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,23 @@
+#include "tile_grid.hpp"
+
+namespace processors {
+    tile_grid::tile_grid(math::uvec2 resolution, uint32_t tile_size)
+        : m_resolution(resolution), m_tile_size(tile_size),
+          m_tile_count((resolution.x + tile_size - 1) / tile_size, (resolution.y + tile_size - 1) / tile_size) {
+    }
+
+    tile tile_grid::get_tile(uint32_t index) const {
+        math::uvec2 origin(index % m_tile_count.x * m_tile_size, index / m_tile_count.x * m_tile_size);
+        math::uvec2 size(std::min(m_tile_size, m_resolution.x - origin.x), std::min(m_tile_size, m_resolution.y - origin.y));
+
+        return {origin, size};
+    }
+
+    uint32_t tile_grid::get_tile_index(uint32_t x, uint32_t y) const {
+        return y / m_tile_size * m_tile_count.x + x / m_tile_size;
+    }
+
+    uint32_t tile_grid::size() const {
+        return m_tile_count.x * m_tile_count.y;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "pch.hpp"
+#include <path_tracer/math/vec2.hpp>
+
+namespace processors {
+    struct tile {
+        math::uvec2 origin;
+        math::uvec2 size;
+    };
+
+    // Splits the image into square tiles in row-major order, the ones on the right and bottom edges may be smaller
+    class tile_grid {
+    public:
+        tile_grid(math::uvec2 resolution, uint32_t tile_size);
+
+        tile get_tile(uint32_t index) const;
+        uint32_t get_tile_index(uint32_t x, uint32_t y) const;
+
+        uint32_t size() const;
+
+    private:
+        math::uvec2 m_resolution;
+        uint32_t m_tile_size;
+        math::uvec2 m_tile_count;
+    };
+}
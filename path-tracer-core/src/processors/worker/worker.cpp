@@ -8,6 +8,11 @@
 #include "path_tracer/util/rand_cone_vec.hpp"
 #include <path_tracer/core/pbr.hpp>
 #include "cloud/s3.hpp"
+#include "cloud/local_transport.hpp"
+#include "cloud/filesystem_image_sink.hpp"
+#include "cloud/s3_image_sink.hpp"
+#include "cloud/ray_wire.hpp"
+#include "checkpoint.hpp"
 #include "models/cloud_ray.hpp"
 #include "worker.hpp"
 
@@ -28,65 +33,161 @@ namespace processors {
         auto& info = m_worker_info;
         auto& work = m_worker_info.scene_info.work;
 
-        m_scene.load_scene(m_worker_info.scene_bucket, m_worker_info.scene_root, work, m_gltf_file_path);
+        m_scene.load_scene(m_worker_info.scene_bucket, m_worker_info.scene_root, work, m_gltf_file_path, info.acceleration, info.mesh_cache_directory);
 
         m_should_terminate = false;
-        m_completed_rays = 0;
+        m_completed_tiles = 0;
+        m_stage_epoch = 0;
 
         this->resolution = fvec2(info.X, info.Y);
         this->sample_count = info.samples;
         this->bounce_count = info.bounces;
 
-        generate_rays();
+        const auto& batch_sizes = info.batch_sizes;
+        if (batch_sizes.object_intersection == 0 || batch_sizes.direct_lighting_intersection == 0
+            || batch_sizes.shading == 0 || batch_sizes.accumulate == 0) {
+            throw std::runtime_error("Stage batch sizes must be at least 1");
+        }
 
-		pixels.resize(resolution.x);
-		for (auto& column : pixels)
-			column.resize(resolution.y, {math::fvec3::zero, 0, false, 0});
+        if (info.tile_size == 0) {
+            throw std::runtime_error("tile_size must be at least 1");
+        }
+
+        if (info.target_error < 0) {
+            throw std::runtime_error("target_error can't be negative");
+        }
+
+        if (info.target_error > 0 && info.adaptive_pass_samples == 0) {
+            throw std::runtime_error("adaptive_pass_samples must be at least 1 when target_error is set");
+        }
+
+        if (info.checkpoint_interval < 0 || info.preview_interval < 0) {
+            throw std::runtime_error("checkpoint_interval and preview_interval can't be negative");
+        }
+
+        // Writing over a checkpoint being resumed from would drop its samples, only the new ones go into ours
+        for (const auto& name : info.resume_checkpoints) {
+            if (name == get_checkpoint_name()) {
+                throw std::runtime_error(fmt::format("Can't resume from {}, this run writes its checkpoints there, raise checkpoint_generation", name));
+            }
+        }
+
+        if (info.max_in_flight_rays == 0) {
+            throw std::runtime_error("max_in_flight_rays must be at least 1");
+        }
+
+        if (info.num_workers < 1 || info.worker_rank >= static_cast<uint32_t>(info.num_workers)) {
+            throw std::runtime_error("worker_rank must be below num_workers");
+        }
+
+        if (info.num_workers > 1) {
+            if (info.transport_directory.empty()) {
+                throw std::runtime_error("Running more than one worker needs a transport_directory");
+            }
+
+            m_transport = std::make_unique<cloud::local_transport>(info.transport_directory, info.worker_rank, info.num_workers);
+        }
 
+        // Leave a core for ray generation and one for the main and monitor threads, which mostly sleep
         unsigned int hardware_threads = std::thread::hardware_concurrency();
+        unsigned int stage_threads = std::max(hardware_threads, 3U) - 2;
 
-        unsigned int available_threads = hardware_threads - 4; // 1 for main, 1 for accumulation, 2 for debug & monitor
-        
-        unsigned int shading_threads = std::ceil(available_threads * .4);
+        if (info.worker_rank != 0) {
+            publish_shard_bounds();
+
+            std::vector<std::thread> threads;
+            for (unsigned int i = 0; i < stage_threads; i++) threads.push_back(std::thread(&worker::serve_remote_queries, this));
+            for (auto& thread : threads) thread.join();
 
-        unsigned int object_intersection_threads = std::ceil(available_threads * .15);
-        unsigned int direct_lighting_intersection_threads = std::ceil(available_threads * .15);
+            m_transport.reset();
 
-        unsigned int object_intersection_result_threads = std::ceil(available_threads * .15);
-        unsigned int direct_lighting_intersection_result_threads = std::ceil(available_threads * .15);
+            if (m_remote_failed) {
+                throw std::runtime_error(fmt::format("Worker {} stopped before worker 0 shut it down", info.worker_rank));
+            }
+
+            spdlog::info("Worker {} was shut down by worker 0", info.worker_rank);
+            return;
+        }
+
+        m_fused = info.fuse_stages && info.num_workers == 1;
+
+        m_shards.emplace(m_transport ? gather_shard_bounds() : std::vector<geometry::aabb>{m_scene.get_bounds()});
+
+        m_rays.resize(info.max_in_flight_rays);
+        for (uint32_t slot = 0; slot < info.max_in_flight_rays; slot++) {
+            m_free_slots.enqueue(slot);
+        }
+
+        m_image = std::make_shared<image::image>(resolution, 4, false, true);
+
+        if (info.output_directory.empty()) {
+            m_image_sink = std::make_unique<cloud::s3_image_sink>(info.scene_bucket, info.scene_root);
+        }
+        else {
+            m_image_sink = std::make_unique<cloud::filesystem_image_sink>(info.output_directory);
+        }
+
+        m_accumulation_buffers.clear();
+        for (unsigned int i = 0; i < stage_threads; i++) {
+            m_accumulation_buffers.push_back(std::make_unique<accumulation_buffer>(resolution));
+        }
+
+        m_resumed_buffer = nullptr;
+
+        size_t pixel_count = static_cast<size_t>(resolution.x) * resolution.y;
+        m_pixel_samples.assign(pixel_count, 0);
+        m_pixel_pass_samples.assign(pixel_count, 0);
+        m_retired_rays = 0;
+
+        if (!info.resume_checkpoints.empty()) {
+            resume_from_checkpoints();
+        }
+
+        // Plans the first pass of every tile, tiles a resumed checkpoint already finished complete here
+        m_tiles.emplace(resolution, info.tile_size);
+        m_tile_remaining_rays = std::vector<std::atomic<uint32_t>>(m_tiles->size());
+        for (uint32_t index = 0; index < m_tiles->size(); index++) {
+            finish_tile_pass(index);
+        }
 
         std::vector<std::thread> threads;
 
-        for (int i = 0; i < object_intersection_threads; i++) threads.push_back(std::thread(&worker::process_object_intersections, this));
-        for (int i = 0; i < object_intersection_result_threads; i++) threads.push_back(std::thread(&worker::process_object_intersection_results, this));
+        threads.push_back(std::thread(&worker::generate_rays, this));
 
-        for (int i = 0; i < direct_lighting_intersection_threads; i++) threads.push_back(std::thread(&worker::process_direct_lighting_intersections, this));
-        for (int i = 0; i < direct_lighting_intersection_result_threads; i++) threads.push_back(std::thread(&worker::process_direct_lighting_intersection_results, this));
+        for (unsigned int i = 0; i < stage_threads; i++) threads.push_back(std::thread(&worker::process_stages, this, i));
 
-        for (int i = 0; i < shading_threads; i++) threads.push_back(std::thread(&worker::process_shading, this));
+        if (m_transport) {
+            threads.push_back(std::thread(&worker::receive_remote_results, this));
+        }
 
-        threads.push_back(std::thread(&worker::process_accumulation, this));
+        if (info.preview_interval > 0 || info.preview_samples > 0 || info.checkpoint_interval > 0) {
+            threads.push_back(std::thread(&worker::publish_progress, this));
+        }
 
         threads.push_back(std::thread(([&]() {
-            uint32_t total_rays = resolution.x * resolution.y * sample_count;
-            while (m_completed_rays < total_rays) {
+            while (m_completed_tiles < m_tiles->size()) {
+                // A failed worker already stopped the render
+                if (m_should_terminate) {
+                    return;
+                }
+
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
             }
             
             m_should_terminate = true;
+            m_stage_epoch++;
+            m_stage_epoch.notify_all();
             spdlog::info("All rays processed, signaling termination");
         })));
 
         threads.push_back(std::thread([&]() {
             while (!m_should_terminate) {
-                spdlog::info("Queue sizes: INTERSECT={}, INTERSECT_RESULT={}, DIRECT={}, DIRECT_RESULT={}, INDIRECT={}, COMPLETED={}",
+                spdlog::info("Queue sizes: INTERSECT={}, DIRECT={}, INDIRECT={}, COMPLETED={}",
                     m_object_intersection_queue.size_approx(),
-                    m_object_intersection_result_queue.size_approx(),
                     m_direct_lighting_intersection_queue.size_approx(),
-                    m_direct_lighting_intersection_result_queue.size_approx(),
                     m_shading_queue.size_approx(),
                     m_accumulate_queue.size_approx());
-                spdlog::info("Completed Rays: {}", m_completed_rays.load());
+                spdlog::info("Completed Tiles: {}/{}", m_completed_tiles.load(), m_tiles->size());
                 std::this_thread::sleep_for(std::chrono::seconds(1));
             }
         }));
@@ -95,13 +196,37 @@ namespace processors {
         
         for (auto& thread : threads) thread.join();
 
+        if (m_remote_failed) {
+            // Closing the connections stops the workers that are still up
+            m_transport.reset();
+            throw std::runtime_error("Render stopped after losing a worker");
+        }
+
         spdlog::info("All threads have completed execution.");
+        spdlog::info("Traced {} camera rays, {:.1f} per pixel", m_retired_rays.load(),
+            static_cast<double>(m_retired_rays.load()) / (static_cast<double>(resolution.x) * resolution.y));
+
+        if (m_transport) {
+            std::vector<uint8_t> frame;
+            cloud::ray_wire::encode(models::message_type::shutdown, 0, std::span<const models::ray_query>(), models::ray_compression::none, frame);
+
+            for (uint32_t peer = 1; peer < static_cast<uint32_t>(info.num_workers); peer++) {
+                m_transport->send_rays(peer, frame);
+            }
+
+            m_transport.reset();
+        }
+
         spdlog::info("Generating Image...");
 
 	    auto png_data = generate_final_image();
-        std::variant<std::filesystem::path, std::vector<uint8_t>> input{png_data};
         spdlog::info("Uploading image...");
-        cloud::s3_upload_object(m_worker_info.scene_bucket, m_worker_info.scene_root + "test.png", input);
+        m_image_sink->publish("test.png", std::move(png_data));
+
+        // Lets the finished frame be merged with other renders of it
+        if (info.checkpoint_interval > 0) {
+            publish_checkpoint();
+        }
     }
 
 
@@ -112,82 +237,452 @@ namespace processors {
     }
 
     void worker::generate_rays() {
+        ray_router router(*this);
+        moodycamel::ConsumerToken free_slots(m_free_slots);
+        moodycamel::ConsumerToken tile_passes(m_tile_passes);
+
+        while (true) {
+            uint32_t index;
+            if (!m_tile_passes.try_dequeue(tile_passes, index)) {
+                // Flush so that the passes we wait on can finish
+                router.flush();
+
+                while (!m_tile_passes.wait_dequeue_timed(tile_passes, index, queue_wait_timeout)) {
+                    if (m_should_terminate) {
+                        return;
+                    }
+                }
+            }
+
+            if (!generate_tile_pass(index, router, free_slots)) {
+                return;
+            }
+        }
+    }
+
+    bool worker::generate_tile_pass(uint32_t index, ray_router& router, moodycamel::ConsumerToken& free_slots) {
         using namespace math;
 
-        for(uint32_t x = 0; x < resolution.x; x++) {
-            for(uint32_t y = 0; y < resolution.y; y++) {
-                for(uint32_t sample = 0; sample < sample_count; sample++) {
+        tile tile = m_tiles->get_tile(index);
+
+        // Once the pass's last ray is pushed it can retire and plan the next pass over m_pixel_pass_samples,
+        // so the pass is copied up front and only the copy is read from here on
+        std::vector<uint32_t> pass_samples(static_cast<size_t>(tile.size.x) * tile.size.y);
+        uint32_t pass_length = 0;
+        for (uint32_t y = 0; y < tile.size.y; y++) {
+            for (uint32_t x = 0; x < tile.size.x; x++) {
+                uint32_t samples = m_pixel_pass_samples[static_cast<size_t>(tile.origin.y + y) * resolution.x + tile.origin.x + x];
+                pass_samples[static_cast<size_t>(y) * tile.size.x + x] = samples;
+                pass_length = std::max(pass_length, samples);
+            }
+        }
+
+        // Neighbouring pixels go out together, so a tile's rays traverse the same geometry and textures
+        for (uint32_t pass_sample = 0; pass_sample < pass_length; pass_sample++) {
+            for (uint32_t y = tile.origin.y; y < tile.origin.y + tile.size.y; y++) {
+                for (uint32_t x = tile.origin.x; x < tile.origin.x + tile.size.x; x++) {
+                    if (pass_sample >= pass_samples[static_cast<size_t>(y - tile.origin.y) * tile.size.x + x - tile.origin.x]) {
+                        continue;
+                    }
+
+                    size_t pixel_index = static_cast<size_t>(y) * resolution.x + x;
+
+                    uint32_t sample = m_pixel_samples[pixel_index]++;
                     uint64_t uuid = ((uint64_t)x << 40) | ((uint64_t)y << 20) | sample;
-                    
+
                     uvec2 pixel(x, y);
 
-					fvec2 aa_offset;
+                    fvec2 aa_offset;
                     if (sample == 0 && !transparent_background) {
                         aa_offset = fvec2(0, 0); 
                     } else {
                         aa_offset = fvec2(core::rand(), core::rand());
                     }
 
-					fvec2 ndc = ((fvec2(pixel) + aa_offset) / resolution) * 2 - fvec2::one;
-					ndc.y = -ndc.y;
-					float ratio = static_cast<float>(resolution.x) / resolution.y;
+                    fvec2 ndc = ((fvec2(pixel) + aa_offset) / resolution) * 2 - fvec2::one;
+                    ndc.y = -ndc.y;
+                    float ratio = static_cast<float>(resolution.x) / resolution.y;
+
+                    geometry::ray ray = m_scene.m_camera->get_component<scene::camera>()->get_ray(ndc, ratio);
+
+                    // Wait for the accumulation stage to retire a ray,
+                    // flushing first so that no buffered ray holds the slot it waits on
+                    uint32_t slot;
+                    if (!m_free_slots.try_dequeue(free_slots, slot)) {
+                        router.flush();
 
-					geometry::ray ray = m_scene.m_camera->get_component<scene::camera>()->get_ray(ndc, ratio);
+                        while (!m_free_slots.wait_dequeue_timed(free_slots, slot, queue_wait_timeout)) {
+                            if (m_should_terminate) {
+                                return false;
+                            }
+                        }
+                    }
 
-                    models::cloud_ray cloud_ray;
+                    models::cloud_ray& cloud_ray = m_rays[slot];
                     cloud_ray.uuid = uuid;
                     cloud_ray.ray = ray;
+                    cloud_ray.direct_light_ray = {};
+                    cloud_ray.surface = {};
+                    cloud_ray.direct_light_occluded = false;
                     cloud_ray.color = fvec4::zero;
                     cloud_ray.scale = fvec3::one;
                     cloud_ray.bounce = bounce_count;
-                    cloud_ray.stage = models::ray_stage::INTERSECT;
 
-                    map_ray_stage_to_queue(cloud_ray);
+                    router.push({slot}, models::ray_stage::INTERSECT);
                 }
-            } 
+            }
         }
+
+        return true;
+    }
+
+    worker::ray_writer::ray_writer(worker& worker, ray_queue& queue, uint32_t batch_size)
+        : m_worker(worker), m_queue(queue), m_token(queue), m_batch_size(batch_size) {
+        m_handles.reserve(batch_size);
     }
 
-    void worker::map_ray_stage_to_queue(const models::cloud_ray& ray) {
-        const models::ray_stage& stage = ray.stage;
+    void worker::ray_writer::push(const models::ray_handle& handle) {
+        m_handles.push_back(handle);
+
+        if (m_handles.size() >= m_batch_size) {
+            flush();
+        }
+    }
 
+    void worker::ray_writer::flush() {
+        if (m_handles.empty()) {
+            return;
+        }
+
+        m_queue.enqueue_bulk(m_token, m_handles.begin(), m_handles.size());
+        m_handles.clear();
+
+        m_worker.notify_stages();
+    }
+
+    worker::ray_router::ray_router(worker& worker)
+        : m_object_intersection(worker, worker.m_object_intersection_queue, worker.m_worker_info.batch_sizes.object_intersection),
+          m_direct_lighting_intersection(worker, worker.m_direct_lighting_intersection_queue, worker.m_worker_info.batch_sizes.direct_lighting_intersection),
+          m_shading(worker, worker.m_shading_queue, worker.m_worker_info.batch_sizes.shading),
+          m_accumulate(worker, worker.m_accumulate_queue, worker.m_worker_info.batch_sizes.accumulate) {
+    }
+
+    void worker::ray_router::push(const models::ray_handle& handle, models::ray_stage stage) {
         switch (stage) {
             case models::ray_stage::INTERSECT:
-                m_object_intersection_queue.enqueue(ray);
+                m_object_intersection.push(handle);
                 break;
             case models::ray_stage::DIRECT_LIGHTING:
-                m_direct_lighting_intersection_queue.enqueue(ray);
+                m_direct_lighting_intersection.push(handle);
                 break;
             case models::ray_stage::SHADING:
-                m_shading_queue.enqueue(ray);
+                m_shading.push(handle);
                 break;
             case models::ray_stage::ACCUMULATE:
-                m_accumulate_queue.enqueue(ray);
+                m_accumulate.push(handle);
                 break;
             default:
                 break;
         }
     }
 
-    std::vector<uint8_t> worker::generate_final_image() {
+    void worker::ray_router::flush() {
+        m_object_intersection.flush();
+        m_direct_lighting_intersection.flush();
+        m_shading.flush();
+        m_accumulate.flush();
+    }
+
+    worker::stage_context::stage_context(worker& worker, accumulation_buffer& accumulation)
+        : object_intersection_consumer(worker.m_object_intersection_queue),
+          direct_lighting_intersection_consumer(worker.m_direct_lighting_intersection_queue),
+          shading_consumer(worker.m_shading_queue),
+          accumulate_consumer(worker.m_accumulate_queue),
+          router(worker),
+          free_slots(worker.m_free_slots),
+          shards(worker.m_worker_info.num_workers),
+          accumulation(accumulation) {
+        const auto& batch_sizes = worker.m_worker_info.batch_sizes;
+
+        handles.resize(std::max({
+            batch_sizes.object_intersection, batch_sizes.direct_lighting_intersection,
+            batch_sizes.shading, batch_sizes.accumulate}));
+        slots.resize(std::max(batch_sizes.object_intersection, batch_sizes.direct_lighting_intersection));
+        retired_slots.resize(batch_sizes.accumulate);
+    }
+
+    void worker::process_stages(size_t index) {
+        stage_context context(*this, *m_accumulation_buffers[index]);
+
+        while (!m_should_terminate) {
+            // Read the epoch before looking at the queues so that rays enqueued in between still wake us
+            uint32_t epoch = m_stage_epoch.load(std::memory_order_acquire);
+
+            auto stage = get_busiest_stage();
+            if (!stage) {
+                m_stage_epoch.wait(epoch, std::memory_order_acquire);
+                continue;
+            }
+
+            switch (*stage) {
+                case stage::object_intersection:
+                    if (m_fused) {
+                        process_fused(context);
+                    }
+                    else {
+                        process_object_intersections(context);
+                    }
+                    break;
+                case stage::direct_lighting_intersection:
+                    process_direct_lighting_intersections(context);
+                    break;
+                case stage::shading:
+                    process_shading(context);
+                    break;
+                case stage::accumulate:
+                    process_accumulation(context);
+                    break;
+            }
+        }
+    }
+
+    std::optional<worker::stage> worker::get_busiest_stage() const {
+        const auto& batch_sizes = m_worker_info.batch_sizes;
+
+        // Later stages come first, so that ties drain rays towards accumulation and free their slots
+        const std::array<std::tuple<stage, const ray_queue&, uint32_t>, 4> stages{{
+            {stage::accumulate, m_accumulate_queue, batch_sizes.accumulate},
+            {stage::shading, m_shading_queue, batch_sizes.shading},
+            {stage::direct_lighting_intersection, m_direct_lighting_intersection_queue, batch_sizes.direct_lighting_intersection},
+            {stage::object_intersection, m_object_intersection_queue, batch_sizes.object_intersection}
+        }};
+
+        std::optional<stage> busiest;
+        float busiest_backlog = 0;
+
+        for (const auto& [queue_stage, queue, batch_size] : stages) {
+            // Backlog in batches, so that stages with larger batches don't win just for queueing more
+            float backlog = static_cast<float>(queue.size_approx()) / batch_size;
+            if (backlog > busiest_backlog) {
+                busiest = queue_stage;
+                busiest_backlog = backlog;
+            }
+        }
+
+        return busiest;
+    }
+
+    void worker::notify_stages() {
+        m_stage_epoch.fetch_add(1, std::memory_order_release);
+        m_stage_epoch.notify_one();
+    }
+
+    void worker::complete_tile(uint32_t index) {
+        // Tiles don't share pixels, so completing threads write to the image without a lock
+        write_region(*m_image, m_tiles->get_tile(index));
+
+        m_completed_tiles.fetch_add(1, std::memory_order_release);
+    }
+
+    void worker::write_region(image::image& image, const tile& region) const {
         using namespace math;
 
-        auto img = std::make_shared<image::image>(resolution, 4, false, true);
+        std::vector<accumulation_buffer::pixel_sum> sums;
+        for (const auto& buffer : m_accumulation_buffers) {
+            buffer->merge_into(sums, region);
+        }
+
+        for (uint32_t y = 0; y < region.size.y; y++) {
+            for (uint32_t x = 0; x < region.size.x; x++) {
+                const auto& sum = sums[static_cast<size_t>(y) * region.size.x + x];
+
+                fvec3 color = sum.color_samples > 0 ? sum.color / static_cast<float>(sum.color_samples) : fvec3::zero;
+                color = core::tonemap_approx_aces(color);
+                float alpha = sum.samples > 0 ? sum.alpha / sum.samples : 0;
+
+                uvec2 pixel = region.origin + uvec2(x, y);
+                image.write(pixel, 0, color.x);
+                image.write(pixel, 1, color.y);
+                image.write(pixel, 2, color.z);
+                image.write(pixel, 3, alpha);
+            }
+        }
+    }
+
+    void worker::finish_tile_pass(uint32_t index) {
+        tile tile = m_tiles->get_tile(index);
+
+        std::vector<accumulation_buffer::pixel_sum> sums;
+        for (const auto& buffer : m_accumulation_buffers) {
+            buffer->merge_into(sums, tile);
+        }
+
+        std::vector<uint8_t> needs_samples(sums.size());
+        for (size_t i = 0; i < sums.size(); i++) {
+            needs_samples[i] = this->needs_samples(sums[i]);
+        }
+
+        uint32_t remaining_rays = 0;
+        for (uint32_t y = 0; y < tile.size.y; y++) {
+            for (uint32_t x = 0; x < tile.size.x; x++) {
+                // A pixel keeps sampling while any neighbour does, few samples can all miss a small light
+                // and look converged, and the noise of one pixel is a hint about the ones next to it
+                bool neighbourhood_needs_samples = false;
+                for (uint32_t ny = y > 0 ? y - 1 : 0; ny <= std::min(y + 1, tile.size.y - 1); ny++) {
+                    for (uint32_t nx = x > 0 ? x - 1 : 0; nx <= std::min(x + 1, tile.size.x - 1); nx++) {
+                        neighbourhood_needs_samples |= needs_samples[static_cast<size_t>(ny) * tile.size.x + nx] != 0;
+                    }
+                }
+
+                const auto& sum = sums[static_cast<size_t>(y) * tile.size.x + x];
+                uint32_t pass_samples = neighbourhood_needs_samples ? get_pass_samples(sum) : 0;
+
+                m_pixel_pass_samples[static_cast<size_t>(tile.origin.y + y) * resolution.x + tile.origin.x + x] = pass_samples;
+                remaining_rays += pass_samples;
+            }
+        }
+
+        if (remaining_rays == 0) {
+            complete_tile(index);
+            return;
+        }
+
+        // The generator copies the pass after taking the tile from the queue, and only then can its rays retire
+        m_tile_remaining_rays[index].store(remaining_rays, std::memory_order_relaxed);
+        m_tile_passes.enqueue(index);
+    }
+
+    bool worker::needs_samples(const accumulation_buffer::pixel_sum& sum) const {
+        const auto& info = m_worker_info;
+
+        if (sum.samples >= sample_count) {
+            return false;
+        }
+
+        if (info.target_error <= 0 || sum.samples < info.adaptive_min_samples) {
+            return true;
+        }
+
+        return accumulation_buffer::get_relative_error(sum) > info.target_error;
+    }
+
+    uint32_t worker::get_pass_samples(const accumulation_buffer::pixel_sum& sum) const {
+        const auto& info = m_worker_info;
+
+        if (sum.samples >= sample_count) {
+            return 0;
+        }
+
+        if (info.target_error <= 0) {
+            return sample_count - sum.samples;
+        }
+
+        uint32_t min_samples = std::min(info.adaptive_min_samples, sample_count);
+        if (sum.samples < min_samples) {
+            return min_samples - sum.samples;
+        }
+
+        return std::min(info.adaptive_pass_samples, sample_count - sum.samples);
+    }
+
+    void worker::publish_progress() {
+        using clock = std::chrono::steady_clock;
+
+        const auto& info = m_worker_info;
+        const auto preview_interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(info.preview_interval));
+        const auto checkpoint_interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(info.checkpoint_interval));
+        const uint64_t pixel_count = static_cast<uint64_t>(resolution.x) * resolution.y;
+
+        auto last_preview_time = clock::now();
+        auto last_checkpoint_time = clock::now();
+        uint64_t last_samples = 0;
+
+        while (!m_should_terminate) {
+            std::this_thread::sleep_for(progress_poll_interval);
+
+            // Average samples per pixel, rays retire tile by tile so some pixels are ahead of others
+            uint64_t samples = m_retired_rays.load(std::memory_order_relaxed) / pixel_count;
+            bool preview_interval_passed = info.preview_interval > 0 && clock::now() - last_preview_time >= preview_interval;
+            bool preview_samples_passed = info.preview_samples > 0 && samples >= last_samples + info.preview_samples;
 
-        for (uint32_t y = 0; y < resolution.y; y++) {
-            for (uint32_t x = 0; x < resolution.x; x++) {
-                fvec3 color = core::tonemap_approx_aces(pixels[x][y].color);
-                float alpha = pixels[x][y].alpha;
+            // Losing a preview or checkpoint isn't worth failing the render for
+            if (preview_interval_passed || preview_samples_passed) {
+                try {
+                    // Reads the buffers while they are accumulated into, a pixel may be a sample behind in one of its sums
+                    image::image preview(resolution, 4, false, true);
+                    write_region(preview, {math::uvec2(0, 0), resolution});
 
-                uvec2 pixel(x, y);
-                img->write(pixel, 0, color.x);
-                img->write(pixel, 1, color.y);
-                img->write(pixel, 2, color.z);
-                img->write(pixel, 3, alpha);
+                    m_image_sink->publish("preview.png", preview.save_to_memory_png());
+                    spdlog::info("Published a preview at {} samples per pixel", samples);
+                }
+                catch (const std::exception& e) {
+                    spdlog::warn("Failed to publish a preview: {}", e.what());
+                }
+
+                last_preview_time = clock::now();
+                last_samples = samples;
+            }
+
+            if (info.checkpoint_interval > 0 && clock::now() - last_checkpoint_time >= checkpoint_interval) {
+                try {
+                    publish_checkpoint();
+                }
+                catch (const std::exception& e) {
+                    spdlog::warn("Failed to publish a checkpoint: {}", e.what());
+                }
+
+                last_checkpoint_time = clock::now();
+            }
+        }
+    }
+
+    void worker::publish_checkpoint() {
+        checkpoint checkpoint;
+        checkpoint.resolution = resolution;
+
+        // Like previews, pixels being accumulated into may be a sample off between their sums and counts.
+        // The resumed sums are left out, they are already in the checkpoints this run resumed from
+        for (const auto& buffer : m_accumulation_buffers) {
+            if (buffer.get() != m_resumed_buffer) {
+                buffer->merge_into(checkpoint.pixels, {math::uvec2(0, 0), resolution});
             }
         }
 
-        return img->save_to_memory_png();
+        std::string name = get_checkpoint_name();
+        m_image_sink->publish(name, checkpoint.encode(models::ray_compression::lz4));
+        spdlog::info("Published {}", name);
+    }
+
+    std::string worker::get_checkpoint_name() const {
+        return fmt::format("checkpoint_{}_{}.bin", m_worker_info.worker_id, m_worker_info.checkpoint_generation);
+    }
+
+    void worker::resume_from_checkpoints() {
+        checkpoint merged;
+
+        for (const auto& name : m_worker_info.resume_checkpoints) {
+            std::vector<uint8_t> data = m_image_sink->fetch(name);
+            merged.merge(checkpoint::decode(data));
+            spdlog::info("Resuming from {}", name);
+        }
+
+        if (merged.resolution.x != resolution.x || merged.resolution.y != resolution.y) {
+            throw std::runtime_error(fmt::format("Checkpoints are {}x{} but the render is {}x{}",
+                merged.resolution.x, merged.resolution.y, resolution.x, resolution.y));
+        }
+
+        // A buffer of its own that no stage thread adds to, so checkpoints can leave it out
+        m_accumulation_buffers.push_back(std::make_unique<accumulation_buffer>(resolution));
+        m_accumulation_buffers.back()->load(merged.pixels);
+        m_resumed_buffer = m_accumulation_buffers.back().get();
+
+        for (size_t i = 0; i < merged.pixels.size(); i++) {
+            m_pixel_samples[i] = merged.pixels[i].samples;
+        }
+    }
+
+    std::vector<uint8_t> worker::generate_final_image() {
+        return m_image->save_to_memory_png();
     }
 
     std::vector<uint8_t> worker::render() const {
@@ -367,9 +862,7 @@ namespace processors {
                             result.position + direct_incoming * math::epsilon,
                             direct_incoming
                         );
-                        auto shadow_result = m_scene.intersect(shadow_ray);
-                        
-                        if (!shadow_result.hit) {
+                        if (!m_scene.occluded(shadow_ray)) {
                             in_shadow = false;
                         }
                     }
@@ -411,9 +904,7 @@ namespace processors {
                         result.position + direct_incoming * math::epsilon,
                         direct_incoming
                     );
-                    auto direct_result = m_scene.intersect(direct_ray);
-                    
-                    if (!direct_result.hit) {
+                    if (!m_scene.occluded(direct_ray)) {
                         // Calculate diffuse BRDF
                         float diffuse_pdf = pbr::pdf_diffuse(normal, direct_incoming);
                         fvec3 diffuse_brdf = diffuse_pdf * albedo;
@@ -5,8 +5,14 @@
 #include "models/work_info.hpp"
 #include "models/cloud_ray.hpp"
 #include "cloud/s3.hpp"
+#include "cloud/transport.hpp"
+#include "cloud/image_sink.hpp"
 #include "scene/scene.hpp"
-#include <concurrentqueue/concurrentqueue.h>
+#include "scene/shard_map.hpp"
+#include "accumulation_buffer.hpp"
+#include "tile_grid.hpp"
+#include <path_tracer/image/image.hpp>
+#include <concurrentqueue/blockingconcurrentqueue.h>
 #include <cstdint>
 #include <sys/types.h>
 
@@ -26,38 +32,166 @@ namespace processors {
     private:
         void download_gltf_file();
 
+        // Generates the passes queued in m_tile_passes until the render terminates
         void generate_rays();
-        void map_ray_stage_to_queue(const models::cloud_ray& ray);
 
-        void process_object_intersections();
-        void process_object_intersection_results();
+        enum class stage {
+            object_intersection,
+            direct_lighting_intersection,
+            shading,
+            accumulate
+        };
+
+        struct stage_context;
+        class ray_router;
+
+        // Returns false if the render terminated while waiting for free slots
+        bool generate_tile_pass(uint32_t index, ray_router& router, moodycamel::ConsumerToken& free_slots);
+
+        // Stage threads are generic, each batch goes to the most backed up stage.
+        // A thread accumulates into the buffer at its index
+        void process_stages(size_t index);
+        std::optional<stage> get_busiest_stage() const;
+        void notify_stages();
+
+        // Each processes one batch and returns the number of rays it took
+        size_t process_object_intersections(stage_context& context);
+        size_t process_direct_lighting_intersections(stage_context& context);
+
+        size_t process_shading(stage_context& context);
+        size_t process_accumulation(stage_context& context);
 
+        // Intersects, tests the shadow ray and shades in one stage, only valid for a single worker
+        size_t process_fused(stage_context& context);
 
+        std::optional<geometry::ray> sample_direct_light_ray(const math::fvec3& position, const math::fvec3& normal) const;
 
-        void process_direct_lighting_intersections();
-        void process_direct_lighting_intersection_results(); 
+        // Rank 0 applies the results other workers send back for its rays
+        void receive_remote_results();
 
-        void process_shading();
-        void process_accumulation();
+        // Every other rank answers queries against its shard until rank 0 shuts it down
+        void serve_remote_queries();
+
+        // Stops the render once a worker sent a frame that can't be used or went away, the rays it holds never come back
+        void fail_remote(const std::string& reason);
+
+        // Rank 0 routes by the bounds every other rank sends it on startup
+        void publish_shard_bounds();
+        std::vector<geometry::aabb> gather_shard_bounds();
 
         std::vector<uint8_t> render() const;
         math::fvec4 trace_iter(uint8_t initial_bounce, const geometry::ray& initial_ray) const;
 
-        // TODO: 
-        /*
-            Simplify lifecycle.
-            Should Only need 3.
-                - Intersection w/ object
-                - Intersection w/ direct light
-                - Accumulate
-            Test with this simplified lifecycle.
-            If not working, test with keeping track of samples and accumulating them in the complete stage
-                i.e ray has vector<samples> sample={direct light, emissive, scale}
-            If not working, test intersection with renderer. Call scene.intersect inside renderer and make sure that is working
-        */
-    
+        // Counts rays of a tile as retired, the thread that retires the last ray of a pass finishes it
+        void retire_tile_rays(uint32_t tile, uint32_t count);
+
+        // Plans the tile's next pass and queues it for the generator, or completes the tile if no pixel needs more samples
+        void finish_tile_pass(uint32_t index);
+        bool needs_samples(const accumulation_buffer::pixel_sum& sum) const;
+
+        // Samples to add to a pixel that needs them or has a neighbour that does
+        uint32_t get_pass_samples(const accumulation_buffer::pixel_sum& sum) const;
+        void complete_tile(uint32_t index);
+
+        // Merges the region from every accumulation buffer and writes it tonemapped into the image
+        void write_region(image::image& image, const tile& region) const;
+
+        // Publishes snapshots of the image through the sink every preview_interval seconds or preview_samples samples,
+        // and checkpoints every checkpoint_interval seconds
+        void publish_progress();
+        void publish_checkpoint();
+
+        // Unique per worker and checkpoint_generation, so a resumed invocation never overwrites the checkpoints it resumed from
+        std::string get_checkpoint_name() const;
+
+        // Merges the checkpoints named in worker_info into the accumulation buffers, so that only the samples they lack are traced
+        void resume_from_checkpoints();
+
         std::vector<uint8_t> generate_final_image();
     private:
+        // The ray generator blocks on free slots for at most this long
+        // before checking m_should_terminate again
+        static constexpr std::chrono::milliseconds queue_wait_timeout{10};
+
+        // How often the progress thread checks whether a preview or checkpoint is due
+        static constexpr std::chrono::milliseconds progress_poll_interval{100};
+
+        // Idle stage threads wait on m_stage_epoch rather than on a queue
+        using ray_queue = moodycamel::ConcurrentQueue<models::ray_handle>;
+
+        // Buffers the handles a thread sends to one queue and
+        // enqueues them in bulk through its own producer token
+        class ray_writer {
+        public:
+            ray_writer(worker& worker, ray_queue& queue, uint32_t batch_size);
+
+            void push(const models::ray_handle& handle);
+            void flush();
+
+        private:
+            worker& m_worker;
+            ray_queue& m_queue;
+            moodycamel::ProducerToken m_token;
+            std::vector<models::ray_handle> m_handles;
+            uint32_t m_batch_size;
+        };
+
+        // Sends rays to the queue of their next stage
+        class ray_router {
+        public:
+            explicit ray_router(worker& worker);
+
+            void push(const models::ray_handle& handle, models::ray_stage stage);
+            void flush();
+
+        private:
+            ray_writer m_object_intersection;
+            ray_writer m_direct_lighting_intersection;
+            ray_writer m_shading;
+            ray_writer m_accumulate;
+        };
+
+        // Rays headed for each shard, gathered so that every shard gets one batch
+        struct shard_queries {
+            explicit shard_queries(uint32_t num_workers);
+
+            std::vector<std::vector<models::ray_query>> queries;
+            std::vector<geometry::ray> geometry_rays;
+            std::vector<models::intersect_result_min> results;
+        };
+
+        // Sends each ray to the next shard on its path, answering for our own shard here,
+        // and routes it on once no shard it reaches can change the result
+        void walk_object_intersections(std::span<const uint32_t> slots, shard_queries& shards, ray_router& router);
+        void walk_direct_lighting_intersections(std::span<const uint32_t> slots, shard_queries& shards, ray_router& router);
+
+        void apply_object_intersection(uint32_t slot, const models::intersect_result_min& result);
+
+        // Sends and clears the queries gathered for other workers
+        void send_queries(models::message_type type, shard_queries& shards);
+
+        // Routes the ray to its next stage once it carries its surface and direct light result
+        void shade(const models::ray_handle& handle, models::cloud_ray& ray, ray_router& router);
+
+        // Buffers and queue tokens a stage thread keeps across batches
+        struct stage_context {
+            stage_context(worker& worker, accumulation_buffer& accumulation);
+
+            std::vector<models::ray_handle> handles;
+            std::vector<uint32_t> slots;
+            std::vector<uint32_t> retired_slots;
+
+            moodycamel::ConsumerToken object_intersection_consumer;
+            moodycamel::ConsumerToken direct_lighting_intersection_consumer;
+            moodycamel::ConsumerToken shading_consumer;
+            moodycamel::ConsumerToken accumulate_consumer;
+
+            ray_router router;
+            moodycamel::ProducerToken free_slots;
+            shard_queries shards;
+            accumulation_buffer& accumulation;
+        };
+
         struct pixel {
             math::fvec3 color;
             float alpha;
@@ -69,22 +203,54 @@ namespace processors {
         models::worker_info m_worker_info;
         std::filesystem::path m_gltf_file_path;
         cloud::distributed_scene m_scene;
-        std::vector<std::vector<pixel>> pixels;
 
-        std::atomic<bool> m_should_terminate;
-        std::atomic<uint32_t> m_completed_rays;
+        // One per stage thread, merged tile by tile as tiles complete
+        std::vector<std::unique_ptr<accumulation_buffer>> m_accumulation_buffers;
+
+        // Extra buffer after the stage threads' ones holding the resumed sums, if any
+        const accumulation_buffer* m_resumed_buffer = nullptr;
+
+        // Rays are generated a tile pass at a time, a tile is tonemapped into m_image once no pixel of it needs more samples
+        std::optional<tile_grid> m_tiles;
+        std::vector<std::atomic<uint32_t>> m_tile_remaining_rays;
+
+        // Samples generated per pixel so far, including resumed ones, only the generator updates them once it runs
+        std::vector<uint32_t> m_pixel_samples;
 
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_object_intersection_queue;
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_object_intersection_result_queue;
+        // Samples each pixel gets in its tile's next pass, planned by whoever finished the tile's last pass
+        std::vector<uint32_t> m_pixel_pass_samples;
+
+        // Tiles with a pass planned, fixed sample counts take one pass and target_error keeps adding them
+        moodycamel::BlockingConcurrentQueue<uint32_t> m_tile_passes;
+        std::atomic<uint64_t> m_retired_rays;
+        std::atomic<uint32_t> m_completed_tiles;
+        std::shared_ptr<image::image> m_image;
+
+        // Receives the final image and previews, S3 unless worker_info.output_directory is set
+        std::unique_ptr<cloud::image_sink> m_image_sink;
+
+        // Single worker, rays skip the direct lighting and shading stages
+        bool m_fused = false;
+
+        // Connects the workers when num_workers > 1
+        std::unique_ptr<cloud::transport> m_transport;
+        std::atomic<bool> m_remote_failed = false;
+
+        std::atomic<bool> m_should_terminate;
 
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_direct_lighting_intersection_queue;
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_direct_lighting_intersection_result_queue;
+        // Bumped whenever rays are enqueued, idle stage threads wait for it to change
+        std::atomic<uint32_t> m_stage_epoch;
 
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_shading_queue;
+        // Payloads of the rays in flight, each owned by whichever stage holds its handle
+        std::vector<models::cloud_ray> m_rays;
+        moodycamel::BlockingConcurrentQueue<uint32_t> m_free_slots;
 
-        moodycamel::ConcurrentQueue<models::cloud_ray> m_accumulate_queue;
+        ray_queue m_object_intersection_queue;
+        ray_queue m_direct_lighting_intersection_queue;
+        ray_queue m_shading_queue;
+        ray_queue m_accumulate_queue;
 
-        std::map<uint64_t, std::pair<int, models::cloud_ray>> m_object_intersection_results;
-        std::map<uint64_t, std::pair<int, models::cloud_ray>> m_direct_lighting_intersection_results;
+        // Bounds of every worker's shard, including ours
+        std::optional<cloud::shard_map> m_shards;
     };
 }
\ No newline at end of file
@@ -6,108 +6,143 @@ using namespace math;
 using namespace scene;
 
 namespace cloud {
-	models::intersect_result_min distributed_scene::intersect_min_result(const geometry::ray& ray) const {
-		std::stack<entity*> stack;
-		for (const auto& [_, entity] : m_entities) {
-			stack.push(entity.get());
-		}
-
+	model::intersection distributed_scene::intersect_nearest(const geometry::ray& ray, const instance*& hit_instance) const {
 		model::intersection nearest_hit;
+		hit_instance = nullptr;
 
-		while (!stack.empty()) {
-			entity* entity = stack.top();
-			stack.pop();
-
-			for (const auto& child : entity->get_children())
-				stack.push(child.get());
+		m_tlas.traverse(ray, [&](uint32_t index) {
+			const instance& instance = m_instances[index];
+			auto hit = instance.model->intersect(ray, instance.transform, instance.inv_transform);
 
-			if (auto model = entity->get_component<scene::model>()) {
-				auto hit = model->intersect(ray);
-
-				if (!hit.has_hit())
-					continue;
-
-				if (hit.distance < nearest_hit.distance
-					|| !nearest_hit.has_hit()) {
-					nearest_hit = hit;
-				}
+			if (hit.has_hit() && (hit.distance < nearest_hit.distance
+				|| !nearest_hit.has_hit())) {
+				nearest_hit = hit;
+				hit_instance = &instance;
 			}
-		}
 
-		if (!nearest_hit.has_hit())
-			return {false, std::numeric_limits<float>::max()};
+			return nearest_hit.distance;
+		});
 
-		transform transform = nearest_hit.transform;
-		fmat3 normal_matrix = transpose(inverse(nearest_hit.transform.basis));
+		return nearest_hit;
+	}
 
+	bool distributed_scene::occluded(const geometry::ray& ray, float max_dist) const {
+		return m_tlas.traverse_any(ray, max_dist, [&](uint32_t index) {
+			const instance& instance = m_instances[index];
+			return instance.model->occluded(ray, instance.transform, instance.inv_transform, max_dist);
+		});
+	}
 
-		const auto& mesh = nearest_hit.surface->mesh;
-		const auto& material = nearest_hit.surface->material;
+	models::intersect_result_min distributed_scene::intersect_min_result(const geometry::ray& ray) const {
+		const instance* hit_instance;
+		model::intersection nearest_hit = intersect_nearest(ray, hit_instance);
 
-		uvec3& indices = mesh->triangles[nearest_hit.triangle_index];
+		return get_min_result(nearest_hit, hit_instance);
+	}
 
-		auto& v1 = mesh->vertices[indices.x];
-		auto& v2 = mesh->vertices[indices.y];
-		auto& v3 = mesh->vertices[indices.z];
+	uint64_t distributed_scene::get_ray_sort_key(const geometry::ray& ray) const {
+		fvec3 dir = ray.get_dir();
+		uint64_t octant = (dir.x < 0) | ((dir.y < 0) << 1) | ((dir.z < 0) << 2);
 
-		fvec3 position = transform * (
-			v1.position * nearest_hit.barycentric.x +
-			v2.position * nearest_hit.barycentric.y +
-			v3.position * nearest_hit.barycentric.z);
+		// 10 bits per axis of the origin within the scene bounds, interleaved into a Morton code
+		const geometry::aabb& bounds = m_tlas.nodes[0].aabb;
+		fvec3 extent = bounds.max - bounds.min;
 
-		fvec2 tex_coord =
-			v1.tex_coord * nearest_hit.barycentric.x +
-			v2.tex_coord * nearest_hit.barycentric.y +
-			v3.tex_coord * nearest_hit.barycentric.z;
-
-		fvec3 normal = normalize(normal_matrix * (
-			v1.normal * nearest_hit.barycentric.x +
-			v2.normal * nearest_hit.barycentric.y +
-			v3.normal * nearest_hit.barycentric.z));
+		auto quantize = [](float value, float min, float extent) {
+			float t = extent > 0 ? (value - min) / extent : 0;
+			return static_cast<uint32_t>(math::min(math::max(t, 0.0F), 1.0F) * 1023);
+		};
 
-		fvec3 tangent = normalize(normal_matrix * (
-			v1.tangent * nearest_hit.barycentric.x +
-			v2.tangent * nearest_hit.barycentric.y +
-			v3.tangent * nearest_hit.barycentric.z));
+		// Spreads the lower 10 bits apart, leaving two zero bits between each
+		auto expand_bits = [](uint32_t v) {
+			v = (v * 0x00010001u) & 0xFF0000FFu;
+			v = (v * 0x00000101u) & 0x0F00F00Fu;
+			v = (v * 0x00000011u) & 0xC30C30C3u;
+			v = (v * 0x00000005u) & 0x49249249u;
+			return v;
+		};
 
-		vec3 binormal = cross(normal, tangent);
-		fmat3 tbn(tangent, binormal, normal);
+		uint32_t morton =
+			expand_bits(quantize(ray.origin.x, bounds.min.x, extent.x)) << 2 |
+			expand_bits(quantize(ray.origin.y, bounds.min.y, extent.y)) << 1 |
+			expand_bits(quantize(ray.origin.z, bounds.min.z, extent.z));
 
-		normal =  tbn * material->get_normal(tex_coord);
-	
-		return {true, nearest_hit.distance, position, normal};
+		// The key is 64-bit so that the z sign bit of the octant isn't shifted out
+		return octant << ray_sort_octant_shift | morton;
 	}
 
+	void distributed_scene::intersect_batch(std::span<const geometry::ray> rays, std::span<models::intersect_result_min> results) const {
+		if (rays.size() != results.size())
+			throw std::runtime_error("intersect_batch needs one result per ray");
 
-    models::intersect_result distributed_scene::intersect(const geometry::ray& ray) const {
-        std::stack<entity*> stack;
-		for (const auto& [_, entity] : m_entities) {
-			stack.push(entity.get());
+		if (m_tlas.empty()) {
+			for (auto& result : results)
+				result = get_min_result({}, nullptr);
+			return;
 		}
 
-		model::intersection nearest_hit;
+		// Sort by key, ray index
+		std::vector<std::pair<uint64_t, uint32_t>> order(rays.size());
+		for (uint32_t i = 0; i < rays.size(); i++)
+			order[i] = {get_ray_sort_key(rays[i]), i};
+
+		std::sort(order.begin(), order.end());
+
+		constexpr uint32_t packet_width = core::bvh::packet_width;
+		std::array<geometry::ray, packet_width> packet;
+		std::array<model::intersection, packet_width> nearest_hits;
+		std::array<const instance*, packet_width> hit_instances;
+
+		size_t begin = 0;
+		while (begin < order.size()) {
+			// Packets never mix direction octants
+			uint64_t octant = order[begin].first >> ray_sort_octant_shift;
+			size_t count = 0;
+
+			while (begin + count < order.size() && count < packet_width
+				&& order[begin + count].first >> ray_sort_octant_shift == octant) {
+				packet[count] = rays[order[begin + count].second];
+				nearest_hits[count] = {};
+				hit_instances[count] = nullptr;
+				count++;
+			}
 
-		while (!stack.empty()) {
-			entity* entity = stack.top();
-			stack.pop();
+			m_tlas.traverse_packet(std::span(packet.data(), count), [&](uint32_t ray_index, uint32_t index) {
+				const instance& instance = m_instances[index];
+				model::intersection& nearest_hit = nearest_hits[ray_index];
+				auto hit = instance.model->intersect(packet[ray_index], instance.transform, instance.inv_transform);
 
-			for (const auto& child : entity->get_children())
-				stack.push(child.get());
+				if (hit.has_hit() && (hit.distance < nearest_hit.distance
+					|| !nearest_hit.has_hit())) {
+					nearest_hit = hit;
+					hit_instances[ray_index] = &instance;
+				}
 
-			if (auto model = entity->get_component<scene::model>()) {
-				auto hit = model->intersect(ray);
+				return nearest_hit.distance;
+			});
 
-				if (!hit.has_hit())
-					continue;
+			for (size_t i = 0; i < count; i++)
+				results[order[begin + i].second] = get_min_result(nearest_hits[i], hit_instances[i]);
 
-				if (hit.distance < nearest_hit.distance
-					|| !nearest_hit.has_hit()) {
-					nearest_hit = hit;
-				}
-			}
+			begin += count;
 		}
+	}
+
+	models::intersect_result_min distributed_scene::get_min_result(const model::intersection& nearest_hit, const instance* hit_instance) const {
+		if (!nearest_hit.has_hit())
+			return {false, std::numeric_limits<float>::max()};
+
+		return {true, nearest_hit.distance, get_result(nearest_hit, hit_instance).get_surface()};
+	}
 
+    models::intersect_result distributed_scene::intersect(const geometry::ray& ray) const {
+		const instance* hit_instance;
+		model::intersection nearest_hit = intersect_nearest(ray, hit_instance);
+
+		return get_result(nearest_hit, hit_instance);
+	}
 
+	models::intersect_result distributed_scene::get_result(const model::intersection& nearest_hit, const instance* hit_instance) const {
 		if (!nearest_hit.has_hit())
 			return {false};
 
@@ -120,8 +155,8 @@ namespace cloud {
 		auto& v3 = mesh->vertices[indices.z];
 
 		// Normals will have to be normalized if transform applies scale
-		transform transform = nearest_hit.transform;
-		fmat3 normal_matrix = transpose(inverse(nearest_hit.transform.basis));
+		const transform& transform = hit_instance->transform;
+		const fmat3& normal_matrix = hit_instance->normal_matrix;
 
 		fvec3 position = transform * (
 			v1.position * nearest_hit.barycentric.x +
@@ -1,15 +1,21 @@
 #include <filesystem>
 #include <stdexcept>
 #include <path_tracer/image/image_texture.hpp>
+#include <path_tracer/util/thread_pool.hpp>
 #include "scene.hpp"
+#include "shard_map.hpp"
 #include "cloud/s3.hpp"
 
 
 namespace cloud {
-    void distributed_scene::load_scene(const std::string& scene_s3_bucket, const std::string& scene_s3_root, const std::map<mesh_name, primitives>& scene_work, const std::filesystem::path& gltf_path) {
+    void distributed_scene::load_scene(const std::string& scene_s3_bucket, const std::string& scene_s3_root, const std::map<mesh_name, primitives>& scene_work, const std::filesystem::path& gltf_path, core::acceleration_structure acceleration, const std::filesystem::path& mesh_cache_directory) {
 		this->m_scene_s3_bucket = scene_s3_bucket;
 		this->m_scene_s3_root = scene_s3_root;
 		this->scene_work = scene_work;
+		this->m_acceleration = acceleration;
+
+		if (!mesh_cache_directory.empty())
+			m_mesh_cache.emplace(mesh_cache_directory);
 
 		uint32_t camera_index = 0;
         uint32_t sun_light_index = 0;
@@ -52,6 +58,9 @@ namespace cloud {
 		if (!m_camera)
 			throw std::runtime_error("Scene is missing a camera.");
 
+		build_meshes();
+		build_tlas();
+
 		cgltf_free(m_data);
 		m_data = nullptr;
 
@@ -139,6 +148,107 @@ namespace cloud {
 		spdlog::info("Loaded: {}", entity->get_name());
 	}
 
+	void distributed_scene::build_meshes() {
+		auto start = std::chrono::steady_clock::now();
+
+		// One job per mesh, large meshes split their own builds further on the same pool
+		std::vector<std::shared_ptr<util::future>> todo;
+		todo.reserve(m_unbuilt_meshes.size());
+
+		for (const auto& [mesh, cache_key] : m_unbuilt_meshes) {
+			todo.push_back(util::thread_pool::common_pool.submit([this, mesh, cache_key](uint32_t) {
+				if (m_acceleration == core::acceleration_structure::bvh)
+					mesh->build_bvh();
+				else
+					mesh->build_kd_tree();
+
+				if (m_mesh_cache)
+					m_mesh_cache->save(*mesh, cache_key);
+			}));
+		}
+
+		// Every job references this scene, so none can still be running once an error is thrown
+		for (const auto& future : todo)
+			future->wait();
+
+		for (const auto& future : todo)
+			future->rethrow();
+
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+		spdlog::info("Built acceleration structures for {} meshes in {:.3f}s", m_unbuilt_meshes.size(), elapsed.count());
+
+		m_unbuilt_meshes.clear();
+	}
+
+	void distributed_scene::build_tlas() {
+		m_instances.clear();
+
+		std::stack<scene::entity*> stack;
+		for (const auto& [_, entity] : m_entities)
+			stack.push(entity.get());
+
+		while (!stack.empty()) {
+			scene::entity* entity = stack.top();
+			stack.pop();
+
+			for (const auto& child : entity->get_children())
+				stack.push(child.get());
+
+			auto model = entity->get_component<scene::model>();
+
+			// Primitives outside of this worker's share of the scene are not loaded
+			if (!model || model->surfaces.empty())
+				continue;
+
+			// Transform all eight corners of the local AABB to world space
+			const scene::transform& transform = entity->get_global_transform();
+			const geometry::aabb& local = model->aabb;
+
+			geometry::aabb world_aabb;
+			for (uint8_t corner = 0; corner < 8; corner++) {
+				math::fvec3 point(
+					corner & 1 ? local.max.x : local.min.x,
+					corner & 2 ? local.max.y : local.min.y,
+					corner & 4 ? local.max.z : local.min.z);
+				point = transform * point;
+
+				if (corner == 0)
+					world_aabb = geometry::aabb(point, point);
+				else
+					world_aabb.add(point);
+			}
+
+			m_instances.push_back({
+				model,
+				transform,
+				transform.inverse(),
+				math::transpose(math::inverse(transform.basis)),
+				world_aabb
+			});
+		}
+
+		std::vector<core::bvh::primitive> primitives;
+		primitives.reserve(m_instances.size());
+
+		for (const auto& instance : m_instances) {
+			const geometry::aabb& bounds = instance.world_aabb;
+			primitives.push_back({bounds, (bounds.min + bounds.max) * 0.5F});
+		}
+
+		m_tlas.build(primitives, 1);
+
+		spdlog::info("Built top-level BVH over {} model instances", m_instances.size());
+	}
+
+	geometry::aabb distributed_scene::get_bounds() const {
+		geometry::aabb bounds = shard_map::get_empty_bounds();
+
+		for (const auto& instance : m_instances)
+			bounds.add(instance.world_aabb);
+
+		return bounds;
+	}
+
     std::shared_ptr<image::texture> distributed_scene::get_cached_texture(const std::string& scene_bucket, const std::string& image_key, bool srgb) {
 		if (m_texture_cache.contains(image_key)) {
 			auto texture = m_texture_cache[image_key].lock();
@@ -212,6 +322,23 @@ namespace cloud {
 		std::vector<unsigned int> indices(primitive->indices->count);
 		cgltf_accessor_unpack_indices(primitive->indices, indices.data(), sizeof(unsigned int), primitive->indices->count);
 
+		// Keyed by everything that goes into the mesh and its tree, builder defaults are covered by mesh_cache::version
+		uint64_t cache_key = 0;
+		if (m_mesh_cache) {
+			cache_key = mesh_cache::hash(&mesh_cache::version, sizeof(mesh_cache::version));
+			cache_key = mesh_cache::hash(&m_acceleration, sizeof(m_acceleration), cache_key);
+			cache_key = mesh_cache::hash(positions.data(), positions.size() * sizeof(float), cache_key);
+			cache_key = mesh_cache::hash(tex_coords.data(), tex_coords.size() * sizeof(float), cache_key);
+			cache_key = mesh_cache::hash(normals.data(), normals.size() * sizeof(float), cache_key);
+			cache_key = mesh_cache::hash(tangents.data(), tangents.size() * sizeof(float), cache_key);
+			cache_key = mesh_cache::hash(indices.data(), indices.size() * sizeof(unsigned int), cache_key);
+
+			if (auto cached_mesh = m_mesh_cache->load(cache_key)) {
+				spdlog::info("Loaded mesh with {} triangles from cache", cached_mesh->triangles.size());
+				return cached_mesh;
+			}
+		}
+
 		auto vertices_size = positions.size() / 3;
 		auto trianges_size = indices.size() / 3;
 
@@ -248,7 +375,9 @@ namespace cloud {
 		}
 
 		mesh->recalculate_aabb();
-		mesh->build_kd_tree();
+
+		// Trees are built for all meshes at once in build_meshes
+		m_unbuilt_meshes.push_back({mesh, cache_key});
 
 		return mesh;
 	}
@@ -0,0 +1,241 @@
+#include "mesh_cache.hpp"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cloud {
+    namespace mesh_cache_format {
+        static constexpr char magic[8] = {'P', 'T', 'M', 'E', 'S', 'H', 0, 0};
+
+        // Sections start on this boundary, enough for the 32-byte aligned triangle packets
+        static constexpr size_t alignment = 64;
+
+        struct header {
+            char magic[8];
+            uint32_t version;
+            uint32_t acceleration;
+            uint64_t key;
+            geometry::aabb aabb;
+
+            uint64_t vertex_count;
+            uint64_t triangle_count;
+            uint64_t kd_tree_node_count;
+            uint64_t kd_tree_packet_count;
+            uint64_t bvh_node_count;
+            uint64_t bvh_index_count;
+        };
+
+        static_assert(std::is_trivially_copyable_v<header>);
+        static_assert(std::is_trivially_copyable_v<core::vertex>);
+        static_assert(std::is_trivially_copyable_v<math::uvec3>);
+        static_assert(std::is_trivially_copyable_v<core::kd_tree_node>);
+        static_assert(std::is_trivially_copyable_v<geometry::triangle_packet>);
+        static_assert(std::is_trivially_copyable_v<core::bvh_node>);
+
+        static size_t align(size_t offset) {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        // Header first, then every array in the order of the counts above
+        template <typename Visit>
+        static size_t for_each_section(const header& header, Visit&& visit) {
+            size_t offset = align(sizeof(mesh_cache_format::header));
+
+            auto section = [&](size_t count, size_t element_size, auto tag) {
+                visit(offset, count, tag);
+                offset = align(offset + count * element_size);
+            };
+
+            section(header.vertex_count, sizeof(core::vertex), static_cast<core::vertex*>(nullptr));
+            section(header.triangle_count, sizeof(math::uvec3), static_cast<math::uvec3*>(nullptr));
+            section(header.kd_tree_node_count, sizeof(core::kd_tree_node), static_cast<core::kd_tree_node*>(nullptr));
+            section(header.kd_tree_packet_count, sizeof(geometry::triangle_packet), static_cast<geometry::triangle_packet*>(nullptr));
+            section(header.bvh_node_count, sizeof(core::bvh_node), static_cast<core::bvh_node*>(nullptr));
+            section(header.bvh_index_count, sizeof(uint32_t), static_cast<uint32_t*>(nullptr));
+
+            return offset;
+        }
+    }
+
+    mesh_cache::mesh_cache(const std::filesystem::path& directory) : m_directory(directory) {
+        // A broken cache only costs the builds it would have saved, so it never fails the scene load
+        std::error_code error;
+        std::filesystem::create_directories(m_directory, error);
+
+        if (error)
+            spdlog::warn("Failed to create mesh cache directory {}: {}", m_directory.string(), error.message());
+    }
+
+    std::shared_ptr<core::mesh> mesh_cache::load(uint64_t key) const {
+        using namespace mesh_cache_format;
+
+        std::filesystem::path path = get_path(key);
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat stat;
+        if (fstat(fd, &stat) != 0 || static_cast<size_t>(stat.st_size) < sizeof(header)) {
+            close(fd);
+            return nullptr;
+        }
+
+        size_t size = stat.st_size;
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+            return nullptr;
+
+        const auto* bytes = static_cast<const uint8_t*>(data);
+
+        header header;
+        std::memcpy(&header, bytes, sizeof(header));
+
+        bool valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0
+            && header.version == version
+            && header.key == key;
+
+        // Bound every count first so that computing the section offsets can't overflow
+        for_each_section(header, [&](size_t, size_t count, auto) { valid = valid && count <= size; });
+        valid = valid && for_each_section(header, [](size_t, size_t, auto) {}) <= size;
+
+        std::shared_ptr<core::mesh> mesh;
+
+        if (valid) {
+            mesh = std::make_shared<core::mesh>();
+            mesh->aabb = header.aabb;
+            mesh->acceleration = static_cast<core::acceleration_structure>(header.acceleration);
+
+            auto copy = [&]<typename T>(std::vector<T>& destination, size_t offset, size_t count) {
+                destination.resize(count);
+                std::memcpy(destination.data(), bytes + offset, count * sizeof(T));
+            };
+
+            for_each_section(header, [&]<typename T>(size_t offset, size_t count, T*) {
+                if constexpr (std::is_same_v<T, core::vertex>)
+                    copy(mesh->vertices, offset, count);
+                else if constexpr (std::is_same_v<T, math::uvec3>)
+                    copy(mesh->triangles, offset, count);
+                else if constexpr (std::is_same_v<T, core::kd_tree_node>)
+                    copy(mesh->kd_tree.nodes, offset, count);
+                else if constexpr (std::is_same_v<T, geometry::triangle_packet>)
+                    copy(mesh->kd_tree.packets, offset, count);
+                else if constexpr (std::is_same_v<T, core::bvh_node>)
+                    copy(mesh->bvh.nodes, offset, count);
+                else
+                    copy(mesh->bvh.indices, offset, count);
+            });
+        }
+        else {
+            spdlog::warn("Ignoring stale mesh cache file {}", path.string());
+        }
+
+        munmap(data, size);
+        return mesh;
+    }
+
+    void mesh_cache::save(const core::mesh& mesh, uint64_t key) const {
+        using namespace mesh_cache_format;
+
+        header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.acceleration = static_cast<uint32_t>(mesh.acceleration);
+        header.key = key;
+        header.aabb = mesh.aabb;
+        header.vertex_count = mesh.vertices.size();
+        header.triangle_count = mesh.triangles.size();
+        header.kd_tree_node_count = mesh.kd_tree.nodes.size();
+        header.kd_tree_packet_count = mesh.kd_tree.packets.size();
+        header.bvh_node_count = mesh.bvh.nodes.size();
+        header.bvh_index_count = mesh.bvh.indices.size();
+
+        std::vector<uint8_t> file(for_each_section(header, [](size_t, size_t, auto) {}), 0);
+        std::memcpy(file.data(), &header, sizeof(header));
+
+        auto copy = [&]<typename T>(const std::vector<T>& source, size_t offset) {
+            std::memcpy(file.data() + offset, source.data(), source.size() * sizeof(T));
+        };
+
+        for_each_section(header, [&]<typename T>(size_t offset, size_t, T*) {
+            if constexpr (std::is_same_v<T, core::vertex>)
+                copy(mesh.vertices, offset);
+            else if constexpr (std::is_same_v<T, math::uvec3>)
+                copy(mesh.triangles, offset);
+            else if constexpr (std::is_same_v<T, core::kd_tree_node>)
+                copy(mesh.kd_tree.nodes, offset);
+            else if constexpr (std::is_same_v<T, geometry::triangle_packet>)
+                copy(mesh.kd_tree.packets, offset);
+            else if constexpr (std::is_same_v<T, core::bvh_node>)
+                copy(mesh.bvh.nodes, offset);
+            else
+                copy(mesh.bvh.indices, offset);
+        });
+
+        // Write next to the final file and rename, so that concurrent
+        // workers never map a partially written snapshot. mkstemp picks a
+        // name no other thread or process on this machine is writing to
+        std::filesystem::path path = get_path(key);
+        std::string temp_path = path.string() + ".XXXXXX";
+
+        int fd = mkstemp(temp_path.data());
+        if (fd < 0) {
+            spdlog::warn("Failed to create mesh cache file {}: {}", temp_path, std::strerror(errno));
+            return;
+        }
+
+        // mkstemp creates the file private to this user
+        fchmod(fd, 0644);
+
+        size_t offset = 0;
+        while (offset < file.size()) {
+            ssize_t count = write(fd, file.data() + offset, file.size() - offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+
+            offset += count;
+        }
+
+        if (close(fd) != 0 || offset < file.size()) {
+            spdlog::error("Failed to write mesh cache file {}", temp_path);
+            unlink(temp_path.c_str());
+            return;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(temp_path, path, error);
+
+        if (error) {
+            spdlog::error("Failed to move mesh cache file {} into place: {}", temp_path, error.message());
+            unlink(temp_path.c_str());
+        }
+    }
+
+    uint64_t mesh_cache::hash(const void* data, size_t size, uint64_t seed) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+
+        for (size_t i = 0; i < size; i++) {
+            seed ^= bytes[i];
+            seed *= 1099511628211ULL;
+        }
+
+        return seed;
+    }
+
+    std::filesystem::path mesh_cache::get_path(uint64_t key) const {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << key << ".mesh";
+        return m_directory / name.str();
+    }
+}
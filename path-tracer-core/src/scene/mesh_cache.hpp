@@ -0,0 +1,29 @@
+#pragma once
+
+#include "pch.hpp"
+#include <path_tracer/core/mesh.hpp>
+
+namespace cloud {
+    // Binary snapshots of loaded meshes together with their built acceleration structure
+    // Lambda keeps /tmp between warm invocations, so repeated renders of a scene map the snapshot instead of building again
+    class mesh_cache {
+    public:
+        // Bump whenever the file layout, a builder or its default parameters change
+        static constexpr uint32_t version = 1;
+
+        explicit mesh_cache(const std::filesystem::path& directory);
+
+        // Returns nullptr when there's no valid snapshot for the key
+        std::shared_ptr<core::mesh> load(uint64_t key) const;
+        void save(const core::mesh& mesh, uint64_t key) const;
+
+        // FNV-1a, chain calls through seed to hash several buffers
+        static uint64_t hash(const void* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+
+    private:
+        std::filesystem::path get_path(uint64_t key) const;
+
+    private:
+        std::filesystem::path m_directory;
+    };
+}
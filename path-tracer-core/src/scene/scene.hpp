@@ -7,8 +7,10 @@
 #include <path_tracer/scene/sun_light.hpp>
 #include <path_tracer/core/mesh.hpp>
 #include <path_tracer/core/material.hpp>
+#include <path_tracer/core/bvh.hpp>
 #include "path_tracer/core/renderer.hpp"
 #include "pch.hpp"
+#include "scene/mesh_cache.hpp"
 #include "models/cloud_ray.hpp"
 #include "models/work_info.hpp"
 #include "models/intersect_result.hpp"
@@ -16,11 +18,40 @@
 namespace cloud {
     class distributed_scene {
     public:
-        void load_scene(const std::string& scene_s3_bucket, const std::string& scene_s3_root, const std::map<mesh_name, primitives>& scene_work, const std::filesystem::path& gltf_path);
+        void load_scene(const std::string& scene_s3_bucket, const std::string& scene_s3_root, const std::map<mesh_name, primitives>& scene_work, const std::filesystem::path& gltf_path, core::acceleration_structure acceleration = core::acceleration_structure::kd_tree, const std::filesystem::path& mesh_cache_directory = {});
         models::intersect_result_min intersect_min_result(const geometry::ray& ray) const;
+
+        // Same as calling intersect_min_result for each ray, results[i] belongs to rays[i]
+        // Rays are reordered by direction octant and origin so that coherent packets share one TLAS walk
+        void intersect_batch(std::span<const geometry::ray> rays, std::span<models::intersect_result_min> results) const;
         models::intersect_result intersect(const geometry::ray& ray) const;
 
+        // Any-hit query for shadow rays, skips finding the nearest hit and attribute interpolation
+        bool occluded(const geometry::ray& ray, float max_dist = std::numeric_limits<float>::max()) const;
+
+        // World bounds of this worker's share of the scene, what other workers route rays by
+        geometry::aabb get_bounds() const;
+
     private:
+        // Model placed in the world, referenced by the top-level BVH
+        // Baked once after load so that no transform math or entity lookups happen per ray
+        struct instance {
+            std::shared_ptr<scene::model> model;
+            scene::transform transform;
+            scene::transform inv_transform;
+            math::fmat3 normal_matrix;
+            geometry::aabb world_aabb;
+        };
+
+        void build_meshes();
+        void build_tlas();
+        scene::model::intersection intersect_nearest(const geometry::ray& ray, const instance*& hit_instance) const;
+        models::intersect_result_min get_min_result(const scene::model::intersection& nearest_hit, const instance* hit_instance) const;
+        models::intersect_result get_result(const scene::model::intersection& nearest_hit, const instance* hit_instance) const;
+        // Direction octant above a 30-bit Morton code of the origin
+        static constexpr uint32_t ray_sort_octant_shift = 30;
+        uint64_t get_ray_sort_key(const geometry::ray& ray) const;
+
         void process_node(cgltf_node* cgltf_node, cgltf_camera* cgltf_camera, cgltf_light* cgltf_sun_light, scene::entity* parent, const std::filesystem::path& gltf_path);
         std::shared_ptr<core::mesh> get_mesh(cgltf_primitive* primitive, const std::filesystem::path& gltf_path);
 		std::shared_ptr<core::material>  get_material(cgltf_primitive* primitive);
@@ -35,12 +66,23 @@ namespace cloud {
         std::string m_scene_s3_bucket;
         std::string m_scene_s3_root;
         std::map<mesh_name, primitives> scene_work;
+        core::acceleration_structure m_acceleration = core::acceleration_structure::kd_tree;
         
         std::unordered_map<std::string, std::shared_ptr<scene::entity>> m_entities;
         std::shared_ptr<scene::entity> m_camera;
 		std::shared_ptr<scene::entity> m_sun_light;
 		std::shared_ptr<image::texture> m_environment;
 
+        // Meshes loaded by get_mesh whose trees are still to be built, along with their cache keys
+        std::vector<std::pair<std::shared_ptr<core::mesh>, uint64_t>> m_unbuilt_meshes;
+
+        // Disabled when load_scene gets no cache directory
+        std::optional<mesh_cache> m_mesh_cache;
+
+        // Top-level BVH over m_instances, each model's meshes hold their own BVH or kD tree
+        std::vector<instance> m_instances;
+        core::bvh m_tlas;
+
         std::unordered_map<std::string, std::weak_ptr<image::texture>> m_texture_cache;
         std::unordered_set<std::string> m_buffers_loaded;
     };
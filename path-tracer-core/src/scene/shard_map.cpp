@@ -0,0 +1,42 @@
+#include "shard_map.hpp"
+
+namespace cloud {
+    shard_map::shard_map(std::vector<geometry::aabb> bounds) : m_bounds(std::move(bounds)) {
+    }
+
+    std::optional<uint32_t> shard_map::next(const geometry::ray& ray, float max_distance, models::shard_walk& walk) const {
+        math::fvec3 inv_dir = math::fvec3::one / ray.get_dir();
+
+        std::optional<uint32_t> next;
+        float next_entry = max_distance;
+
+        for (uint32_t shard = 0; shard < m_bounds.size(); shard++) {
+            auto intersection = m_bounds[shard].intersect(ray, inv_dir);
+            if (!intersection.has_hit())
+                continue;
+
+            // Rays starting inside a shard enter it right away
+            float entry = math::max(intersection.near, 0.0F);
+
+            bool visited = entry < walk.entry || (entry == walk.entry && shard <= walk.shard);
+            if (visited || entry >= next_entry)
+                continue;
+
+            next = shard;
+            next_entry = entry;
+        }
+
+        if (next)
+            walk = {next_entry, *next};
+
+        return next;
+    }
+
+    uint32_t shard_map::size() const {
+        return static_cast<uint32_t>(m_bounds.size());
+    }
+
+    geometry::aabb shard_map::get_empty_bounds() {
+        return geometry::aabb(math::fvec3(std::numeric_limits<float>::max()), math::fvec3(-std::numeric_limits<float>::max()));
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "pch.hpp"
+#include "models/cloud_ray.hpp"
+#include <path_tracer/geometry/aabb.hpp>
+
+namespace cloud {
+    // World bounds of every worker's shard, indexed by rank. Rays only visit the shards
+    // whose bounds they pass through, ordered by where they enter them, ties by rank
+    class shard_map {
+    public:
+        explicit shard_map(std::vector<geometry::aabb> bounds);
+
+        // Advances walk to the next shard the ray enters before max_distance, if any
+        std::optional<uint32_t> next(const geometry::ray& ray, float max_distance, models::shard_walk& walk) const;
+
+        uint32_t size() const;
+
+        // Bounds of a shard without geometry, no ray enters them
+        static geometry::aabb get_empty_bounds();
+
+    private:
+        std::vector<geometry::aabb> m_bounds;
+    };
+}
@@ -0,0 +1,234 @@
+#include <gtest/gtest.h>
+
+#include "processors/worker/checkpoint.hpp"
+
+using namespace math;
+
+// Checkpoints outlive the invocation that wrote them, so they have to come back exactly,
+// and a truncated or corrupt file has to be rejected by throwing
+namespace {
+	using compression = models::ray_compression;
+	using pixel_sum = processors::accumulation_buffer::pixel_sum;
+
+	constexpr compression compressions[] = {compression::none, compression::lz4};
+
+	// Offsets into the header: magic, version, compression, width, height, payload size
+	constexpr size_t version_offset = 4;
+	constexpr size_t compression_offset = 6;
+	constexpr size_t width_offset = 8;
+	constexpr size_t height_offset = 12;
+	constexpr size_t payload_size_offset = 16;
+	constexpr size_t header_size = 20;
+
+	struct random_checkpoints {
+		std::mt19937 rng{42};
+		std::uniform_real_distribution<float> uniform{0, 10};
+
+		// A mostly black frame compresses, a noisy one doesn't
+		processors::checkpoint get_checkpoint(uvec2 resolution, bool repetitive) {
+			processors::checkpoint checkpoint;
+			checkpoint.resolution = resolution;
+			checkpoint.pixels.resize(static_cast<size_t>(resolution.x) * resolution.y);
+
+			for (auto& pixel : checkpoint.pixels) {
+				if (repetitive && rng() % 8 != 0) {
+					pixel.samples = 16;
+					continue;
+				}
+
+				pixel.color = fvec3(uniform(rng), uniform(rng), uniform(rng));
+				pixel.alpha = uniform(rng);
+				pixel.luminance_squared = uniform(rng);
+				pixel.samples = rng() % 256;
+				pixel.color_samples = rng() % 256;
+			}
+
+			return checkpoint;
+		}
+	};
+
+	void expect_equal(const pixel_sum& expected, const pixel_sum& actual) {
+		EXPECT_EQ(expected.color.x, actual.color.x);
+		EXPECT_EQ(expected.color.y, actual.color.y);
+		EXPECT_EQ(expected.color.z, actual.color.z);
+		EXPECT_EQ(expected.alpha, actual.alpha);
+		EXPECT_EQ(expected.luminance_squared, actual.luminance_squared);
+		EXPECT_EQ(expected.samples, actual.samples);
+		EXPECT_EQ(expected.color_samples, actual.color_samples);
+	}
+
+	void expect_equal(const processors::checkpoint& expected, const processors::checkpoint& actual) {
+		ASSERT_EQ(expected.resolution.x, actual.resolution.x);
+		ASSERT_EQ(expected.resolution.y, actual.resolution.y);
+		ASSERT_EQ(expected.pixels.size(), actual.pixels.size());
+
+		for (size_t i = 0; i < expected.pixels.size(); i++)
+			expect_equal(expected.pixels[i], actual.pixels[i]);
+	}
+
+	template <typename T>
+	T get_field(const std::vector<uint8_t>& data, size_t offset) {
+		T value;
+		std::memcpy(&value, data.data() + offset, sizeof(value));
+		return value;
+	}
+
+	template <typename T>
+	void set_field(std::vector<uint8_t>& data, size_t offset, T value) {
+		std::memcpy(data.data() + offset, &value, sizeof(value));
+	}
+
+	std::vector<uint8_t> get_data(compression compression) {
+		random_checkpoints random;
+		auto data = random.get_checkpoint(uvec2(40, 30), true).encode(compression);
+
+		// Otherwise the compressed cases would test the uncompressed path twice
+		EXPECT_EQ(get_field<uint16_t>(data, compression_offset), static_cast<uint16_t>(compression));
+		return data;
+	}
+
+	// Whatever the data holds, decoding either throws runtime_error or yields as many pixels as the resolution says
+	void expect_decode_rejects_or_reads(std::span<const uint8_t> data) {
+		try {
+			auto checkpoint = processors::checkpoint::decode(data);
+			EXPECT_EQ(checkpoint.pixels.size(), static_cast<size_t>(checkpoint.resolution.x) * checkpoint.resolution.y);
+		}
+		catch (const std::runtime_error&) {
+		}
+	}
+}
+
+TEST(checkpoint, round_trips) {
+	random_checkpoints random;
+	bool compressed = false;
+
+	for (uint32_t i = 0; i < 50; i++) {
+		uvec2 resolution(1 + random.rng() % 64, 1 + random.rng() % 64);
+		auto checkpoint = random.get_checkpoint(resolution, i % 2 == 0);
+
+		for (auto compression : compressions) {
+			auto data = checkpoint.encode(compression);
+			compressed |= get_field<uint16_t>(data, compression_offset) != static_cast<uint16_t>(compression::none);
+
+			expect_equal(checkpoint, processors::checkpoint::decode(data));
+		}
+	}
+
+	// Otherwise only the uncompressed path was exercised
+	EXPECT_TRUE(compressed);
+}
+
+TEST(checkpoint, empty_frame_round_trips) {
+	processors::checkpoint checkpoint;
+
+	for (auto compression : compressions)
+		expect_equal(checkpoint, processors::checkpoint::decode(checkpoint.encode(compression)));
+}
+
+TEST(checkpoint, merge_adds_every_sum) {
+	random_checkpoints random;
+	auto a = random.get_checkpoint(uvec2(16, 8), false);
+	auto b = random.get_checkpoint(uvec2(16, 8), false);
+
+	auto merged = a;
+	merged.merge(b);
+
+	ASSERT_EQ(merged.pixels.size(), a.pixels.size());
+	for (size_t i = 0; i < a.pixels.size(); i++) {
+		const auto& pixel = merged.pixels[i];
+		EXPECT_EQ(pixel.color.x, a.pixels[i].color.x + b.pixels[i].color.x);
+		EXPECT_EQ(pixel.color.y, a.pixels[i].color.y + b.pixels[i].color.y);
+		EXPECT_EQ(pixel.color.z, a.pixels[i].color.z + b.pixels[i].color.z);
+		EXPECT_EQ(pixel.alpha, a.pixels[i].alpha + b.pixels[i].alpha);
+		EXPECT_EQ(pixel.luminance_squared, a.pixels[i].luminance_squared + b.pixels[i].luminance_squared);
+		EXPECT_EQ(pixel.samples, a.pixels[i].samples + b.pixels[i].samples);
+		EXPECT_EQ(pixel.color_samples, a.pixels[i].color_samples + b.pixels[i].color_samples);
+	}
+}
+
+TEST(checkpoint, merge_into_an_empty_checkpoint_copies) {
+	random_checkpoints random;
+	auto other = random.get_checkpoint(uvec2(16, 8), false);
+
+	processors::checkpoint merged;
+	merged.merge(other);
+
+	expect_equal(other, merged);
+}
+
+TEST(checkpoint, merging_a_different_resolution_throws) {
+	random_checkpoints random;
+	auto checkpoint = random.get_checkpoint(uvec2(16, 8), false);
+
+	EXPECT_THROW(checkpoint.merge(random.get_checkpoint(uvec2(8, 16), false)), std::runtime_error);
+	EXPECT_THROW(checkpoint.merge(random.get_checkpoint(uvec2(16, 9), false)), std::runtime_error);
+}
+
+TEST(checkpoint, truncated_checkpoints_throw) {
+	for (auto compression : compressions) {
+		auto data = get_data(compression);
+
+		for (size_t size = 0; size < data.size(); size++)
+			EXPECT_THROW(processors::checkpoint::decode(std::span<const uint8_t>(data.data(), size)), std::runtime_error);
+	}
+}
+
+TEST(checkpoint, corrupt_headers_throw) {
+	for (auto compression : compressions) {
+		const auto data = get_data(compression);
+
+		auto corrupt = [&]<typename T>(size_t offset, T value) {
+			auto copy = data;
+			set_field(copy, offset, value);
+			return copy;
+		};
+
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(0, uint32_t(0))), std::runtime_error);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(version_offset, uint16_t(0xFFFF))), std::runtime_error);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(compression_offset, uint16_t(7))), std::runtime_error);
+
+		uint32_t payload_size = get_field<uint32_t>(data, payload_size_offset);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(payload_size_offset, payload_size + 1)), std::runtime_error);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(payload_size_offset, payload_size - 1)), std::runtime_error);
+
+		uint32_t width = get_field<uint32_t>(data, width_offset);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(width_offset, width + 1)), std::runtime_error);
+		EXPECT_THROW(processors::checkpoint::decode(corrupt(width_offset, width - 1)), std::runtime_error);
+
+		// The product would wrap around to a small size if it were multiplied out unchecked
+		auto huge = corrupt(width_offset, uint32_t(0xFFFFFFFF));
+		set_field(huge, height_offset, uint32_t(0xFFFFFFFF));
+		EXPECT_THROW(processors::checkpoint::decode(huge), std::runtime_error);
+	}
+
+	// Well below the size limit, but more than the compressed payload could expand to
+	auto data = get_data(compression::lz4);
+	set_field(data, width_offset, uint32_t(4096));
+	set_field(data, height_offset, uint32_t(4096));
+	EXPECT_THROW(processors::checkpoint::decode(data), std::runtime_error);
+
+	// Uncompressed pixels claimed to be compressed
+	data = get_data(compression::none);
+	set_field(data, compression_offset, static_cast<uint16_t>(compression::lz4));
+	EXPECT_THROW(processors::checkpoint::decode(data), std::runtime_error);
+}
+
+TEST(checkpoint, corrupt_payloads_throw_or_decode_in_bounds) {
+	std::mt19937 rng{42};
+
+	for (auto compression : compressions) {
+		const auto data = get_data(compression);
+
+		for (uint32_t i = 0; i < 2000; i++) {
+			auto corrupt = data;
+			uint32_t flips = 1 + rng() % 8;
+
+			for (uint32_t flip = 0; flip < flips; flip++) {
+				size_t index = header_size + rng() % (corrupt.size() - header_size);
+				corrupt[index] ^= static_cast<uint8_t>(1 + rng() % 255);
+			}
+
+			expect_decode_rejects_or_reads(corrupt);
+		}
+	}
+}
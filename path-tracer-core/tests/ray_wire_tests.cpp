@@ -0,0 +1,344 @@
+#include <gtest/gtest.h>
+
+#include "cloud/ray_wire.hpp"
+
+using namespace math;
+
+// Random batches have to survive a round trip with and without compression,
+// and frames that were cut short or corrupted have to be rejected by throwing
+namespace {
+	using compression = models::ray_compression;
+
+	constexpr uint32_t batch_count = 200;
+	constexpr uint32_t max_batch_size = 600;
+	constexpr compression compressions[] = {compression::none, compression::lz4};
+
+	struct random_records {
+		std::mt19937 rng{42};
+		std::uniform_real_distribution<float> uniform{-100, 100};
+
+		// Some batches repeat values so that they compress, the others mostly don't
+		bool repetitive = false;
+
+		float get_float() {
+			return repetitive ? 1.0F : uniform(rng);
+		}
+
+		fvec3 get_vector() {
+			if (repetitive)
+				return fvec3(1, 2, 3);
+
+			return fvec3(uniform(rng), uniform(rng), uniform(rng));
+		}
+
+		uint32_t get_slot() {
+			return repetitive ? rng() % 4 : static_cast<uint32_t>(rng());
+		}
+
+		geometry::ray get_ray() {
+			return geometry::ray(get_vector(), get_vector() + fvec3(0.5F));
+		}
+
+		models::ray_query get_query() {
+			return {get_slot(), get_ray()};
+		}
+
+		models::intersect_reply get_intersect_reply() {
+			models::intersect_reply reply{};
+			reply.slot = get_slot();
+			reply.result.hit = rng() % 2;
+			reply.result.distance = reply.result.hit ? get_float() : std::numeric_limits<float>::max();
+
+			if (reply.result.hit) {
+				reply.result.surface = {get_vector(), normalize(get_vector() + fvec3(0.5F)), fvec3(get_float()), fvec3(get_float()),
+					get_float(), get_float(), get_float(), get_float(), rng() % 2 == 0};
+			}
+
+			return reply;
+		}
+
+		models::occluded_reply get_occluded_reply() {
+			return {get_slot(), rng() % 2 == 0};
+		}
+
+		geometry::aabb get_aabb() {
+			fvec3 min = get_vector();
+			return geometry::aabb(min, min + fvec3(1));
+		}
+
+		template <typename T>
+		std::vector<T> get_batch() {
+			repetitive = rng() % 2;
+			std::vector<T> batch(rng() % max_batch_size);
+
+			for (auto& item : batch) {
+				if constexpr (std::is_same_v<T, models::ray_query>)
+					item = get_query();
+				else if constexpr (std::is_same_v<T, models::intersect_reply>)
+					item = get_intersect_reply();
+				else if constexpr (std::is_same_v<T, models::occluded_reply>)
+					item = get_occluded_reply();
+				else
+					item = get_aabb();
+			}
+
+			return batch;
+		}
+	};
+
+	// Directions are normalized again when read and normals are octahedral encoded,
+	// everything else has to come back exactly
+	void expect_equal(const fvec3& expected, const fvec3& actual) {
+		EXPECT_EQ(expected.x, actual.x);
+		EXPECT_EQ(expected.y, actual.y);
+		EXPECT_EQ(expected.z, actual.z);
+	}
+
+	void expect_near(const fvec3& expected, const fvec3& actual, float tolerance) {
+		EXPECT_NEAR(expected.x, actual.x, tolerance);
+		EXPECT_NEAR(expected.y, actual.y, tolerance);
+		EXPECT_NEAR(expected.z, actual.z, tolerance);
+	}
+
+	void expect_equal(const models::ray_query& expected, const models::ray_query& actual) {
+		EXPECT_EQ(expected.slot, actual.slot);
+		expect_equal(expected.ray.origin, actual.ray.origin);
+		expect_near(expected.ray.get_dir(), actual.ray.get_dir(), 1e-6F);
+	}
+
+	void expect_equal(const models::intersect_reply& expected, const models::intersect_reply& actual) {
+		EXPECT_EQ(expected.slot, actual.slot);
+		EXPECT_EQ(expected.result.hit, actual.result.hit);
+		EXPECT_EQ(expected.result.distance, actual.result.distance);
+
+		if (!expected.result.hit)
+			return;
+
+		const auto& a = expected.result.surface;
+		const auto& b = actual.result.surface;
+		expect_equal(a.position, b.position);
+		expect_near(a.normal, b.normal, 1e-3F);
+		expect_equal(a.albedo, b.albedo);
+		expect_equal(a.emissive, b.emissive);
+		EXPECT_EQ(a.opacity, b.opacity);
+		EXPECT_EQ(a.roughness, b.roughness);
+		EXPECT_EQ(a.metallic, b.metallic);
+		EXPECT_EQ(a.ior, b.ior);
+		EXPECT_EQ(a.shadow_catcher, b.shadow_catcher);
+	}
+
+	void expect_equal(const models::occluded_reply& expected, const models::occluded_reply& actual) {
+		EXPECT_EQ(expected.slot, actual.slot);
+		EXPECT_EQ(expected.occluded, actual.occluded);
+	}
+
+	void expect_equal(const geometry::aabb& expected, const geometry::aabb& actual) {
+		expect_equal(expected.min, actual.min);
+		expect_equal(expected.max, actual.max);
+	}
+
+	template <typename T>
+	void expect_round_trip() {
+		random_records random;
+		std::vector<uint8_t> frame;
+		std::vector<uint8_t> scratch;
+		bool compressed = false;
+
+		for (uint32_t i = 0; i < batch_count; i++) {
+			auto batch = random.template get_batch<T>();
+
+			for (auto compression : compressions) {
+				cloud::ray_wire::encode(models::message_type::intersect, 3, std::span<const T>(batch), compression, frame);
+
+				auto header = cloud::ray_wire::read_header(frame);
+				EXPECT_EQ(header.type, static_cast<uint32_t>(models::message_type::intersect));
+				EXPECT_EQ(header.source, 3U);
+				EXPECT_EQ(header.count, batch.size());
+				EXPECT_EQ(header.payload_size, frame.size() - sizeof(header));
+				compressed |= header.compression != static_cast<uint16_t>(compression::none);
+
+				auto records = cloud::ray_wire::decode<T>(frame, scratch);
+				ASSERT_EQ(records.size(), batch.size());
+
+				size_t index = 0;
+				for (const auto& record : records)
+					expect_equal(batch[index++], record);
+
+				ASSERT_EQ(index, batch.size());
+			}
+		}
+
+		// Otherwise only the uncompressed path was exercised
+		EXPECT_TRUE(compressed);
+	}
+
+	// Whatever the frame holds, decoding either succeeds within its bounds or throws runtime_error
+	template <typename T>
+	void expect_decode_rejects_or_reads(std::span<const uint8_t> frame) {
+		std::vector<uint8_t> scratch;
+
+		try {
+			auto records = cloud::ray_wire::decode<T>(frame, scratch);
+			for (const auto& record : records)
+				(void)record;
+		}
+		catch (const std::runtime_error&) {
+		}
+	}
+
+	std::vector<uint8_t> get_frame(compression compression) {
+		random_records random;
+		random.repetitive = true;
+
+		std::vector<models::intersect_reply> batch(64);
+		for (auto& reply : batch)
+			reply = random.get_intersect_reply();
+
+		std::vector<uint8_t> frame;
+		cloud::ray_wire::encode(models::message_type::intersect_result, 1, std::span<const models::intersect_reply>(batch), compression, frame);
+		return frame;
+	}
+
+	void set_header(std::vector<uint8_t>& frame, const cloud::ray_wire::header& header) {
+		std::memcpy(frame.data(), &header, sizeof(header));
+	}
+}
+
+TEST(ray_wire, ray_queries_round_trip) {
+	expect_round_trip<models::ray_query>();
+}
+
+TEST(ray_wire, intersect_replies_round_trip) {
+	expect_round_trip<models::intersect_reply>();
+}
+
+TEST(ray_wire, occluded_replies_round_trip) {
+	expect_round_trip<models::occluded_reply>();
+}
+
+TEST(ray_wire, shard_bounds_round_trip) {
+	expect_round_trip<geometry::aabb>();
+}
+
+TEST(ray_wire, truncated_frames_throw) {
+	for (auto compression : compressions) {
+		auto frame = get_frame(compression);
+		std::vector<uint8_t> scratch;
+
+		for (size_t size = 0; size < frame.size(); size++) {
+			std::span<const uint8_t> truncated(frame.data(), size);
+
+			if (size < sizeof(cloud::ray_wire::header)) {
+				EXPECT_THROW(cloud::ray_wire::read_header(truncated), std::runtime_error);
+			}
+
+			EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(truncated, scratch), std::runtime_error);
+		}
+	}
+}
+
+TEST(ray_wire, corrupt_headers_throw) {
+	std::vector<uint8_t> scratch;
+
+	for (auto compression : compressions) {
+		auto frame = get_frame(compression);
+		const auto header = cloud::ray_wire::read_header(frame);
+		ASSERT_EQ(header.compression, static_cast<uint16_t>(compression));
+
+		auto corrupt = [&](auto change) {
+			auto copy = frame;
+			auto changed = header;
+			change(changed);
+			set_header(copy, changed);
+			return copy;
+		};
+
+		auto wrong_magic = corrupt([](auto& header) { header.magic ^= 1; });
+		EXPECT_THROW(cloud::ray_wire::read_header(wrong_magic), std::runtime_error);
+		EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(wrong_magic, scratch), std::runtime_error);
+
+		auto wrong_version = corrupt([](auto& header) { header.version++; });
+		EXPECT_THROW(cloud::ray_wire::read_header(wrong_version), std::runtime_error);
+
+		auto unknown_compression = corrupt([](auto& header) { header.compression = 7; });
+		EXPECT_THROW(cloud::ray_wire::read_header(unknown_compression), std::runtime_error);
+
+		auto huge_payload = corrupt([](auto& header) { header.payload_size = 0xFFFFFFFF; });
+		EXPECT_THROW(cloud::ray_wire::read_header(huge_payload), std::runtime_error);
+
+		auto longer_payload = corrupt([](auto& header) { header.payload_size++; });
+		EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(longer_payload, scratch), std::runtime_error);
+
+		auto more_records = corrupt([](auto& header) { header.count++; });
+		EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(more_records, scratch), std::runtime_error);
+
+		auto fewer_records = corrupt([](auto& header) { header.count--; });
+		EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(fewer_records, scratch), std::runtime_error);
+
+		auto huge_count = corrupt([](auto& header) { header.count = 0xFFFFFFFF; });
+		EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(huge_count, scratch), std::runtime_error);
+	}
+
+	// A frame claiming compression over records that were never compressed
+	auto frame = get_frame(compression::none);
+	auto header = cloud::ray_wire::read_header(frame);
+	header.compression = static_cast<uint16_t>(compression::lz4);
+	set_header(frame, header);
+	EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(frame, scratch), std::runtime_error);
+}
+
+TEST(ray_wire, compressed_records_with_an_inflated_count_throw) {
+	auto frame = get_frame(compression::lz4);
+	auto header = cloud::ray_wire::read_header(frame);
+
+	// Well below max_records_size, but more than the payload could expand to
+	header.count = static_cast<uint32_t>((cloud::ray_wire::max_records_size / cloud::ray_wire::record<models::intersect_reply>::size) - 1);
+	set_header(frame, header);
+
+	std::vector<uint8_t> scratch;
+	EXPECT_THROW(cloud::ray_wire::decode<models::intersect_reply>(frame, scratch), std::runtime_error);
+	EXPECT_LT(scratch.capacity(), cloud::ray_wire::max_records_size);
+}
+
+TEST(ray_wire, corrupt_payloads_throw_or_decode_in_bounds) {
+	std::mt19937 rng{42};
+
+	for (auto compression : compressions) {
+		const auto frame = get_frame(compression);
+
+		for (uint32_t i = 0; i < 2000; i++) {
+			auto corrupt = frame;
+			uint32_t flips = 1 + rng() % 8;
+
+			for (uint32_t flip = 0; flip < flips; flip++) {
+				size_t index = sizeof(cloud::ray_wire::header) + rng() % (corrupt.size() - sizeof(cloud::ray_wire::header));
+				corrupt[index] ^= static_cast<uint8_t>(1 + rng() % 255);
+			}
+
+			expect_decode_rejects_or_reads<models::intersect_reply>(corrupt);
+		}
+	}
+}
+
+TEST(ray_wire, random_bytes_after_a_valid_header_throw_or_decode_in_bounds) {
+	std::mt19937 rng{42};
+
+	for (uint32_t i = 0; i < 2000; i++) {
+		std::vector<uint8_t> frame(sizeof(cloud::ray_wire::header) + rng() % 4096);
+		for (auto& byte : frame)
+			byte = static_cast<uint8_t>(rng());
+
+		cloud::ray_wire::header header{
+			cloud::ray_wire::magic,
+			cloud::ray_wire::version,
+			static_cast<uint16_t>(rng() % 2),
+			static_cast<uint32_t>(models::message_type::intersect),
+			0,
+			static_cast<uint32_t>(rng() % 256),
+			static_cast<uint32_t>(frame.size() - sizeof(cloud::ray_wire::header))
+		};
+		set_header(frame, header);
+
+		expect_decode_rejects_or_reads<models::ray_query>(frame);
+	}
+}
@@ -0,0 +1,189 @@
+#include <gtest/gtest.h>
+
+#include "path_tracer/geometry/triangle_packet.hpp"
+
+using namespace math;
+
+// Every vector kernel has to match the scalar one bit for bit,
+// kernels the CPU running the tests lacks are skipped
+namespace {
+	using kernel = geometry::triangle_packet::kernel;
+
+	constexpr uint32_t packet_count = 2000;
+	constexpr uint32_t rays_per_packet = 16;
+
+	std::vector<kernel> get_vector_kernels() {
+		std::vector<kernel> kernels;
+		for (auto candidate : {kernel::sse, kernel::avx}) {
+			if (geometry::triangle_packet::is_supported(candidate))
+				kernels.push_back(candidate);
+		}
+
+		return kernels;
+	}
+
+	uint32_t get_bits(float value) {
+		return std::bit_cast<uint32_t>(value);
+	}
+
+	void expect_identical(
+		const geometry::triangle_packet::intersection& expected,
+		const geometry::triangle_packet::intersection& actual,
+		kernel tested) {
+		SCOPED_TRACE(tested == kernel::avx ? "avx" : "sse");
+
+		ASSERT_EQ(get_bits(expected.distance), get_bits(actual.distance));
+		if (!expected.has_hit())
+			return;
+
+		EXPECT_EQ(expected.lane, actual.lane);
+		EXPECT_EQ(get_bits(expected.barycentric.x), get_bits(actual.barycentric.x));
+		EXPECT_EQ(get_bits(expected.barycentric.y), get_bits(actual.barycentric.y));
+		EXPECT_EQ(get_bits(expected.barycentric.z), get_bits(actual.barycentric.z));
+	}
+
+	void expect_kernels_match(const geometry::triangle_packet& packet, const geometry::ray& ray, float max_dist) {
+		auto expected = packet.intersect(ray, max_dist, kernel::scalar);
+
+		for (auto tested : get_vector_kernels())
+			expect_identical(expected, packet.intersect(ray, max_dist, tested), tested);
+	}
+
+	struct random_packets {
+		std::mt19937 rng{42};
+		std::uniform_real_distribution<float> uniform{-1, 1};
+
+		fvec3 get_point() {
+			return fvec3(uniform(rng), uniform(rng), uniform(rng));
+		}
+
+		// triangle only references its vertices, so they are kept by value here
+		using vertices = std::array<fvec3, 3>;
+
+		vertices get_triangle() {
+			return {get_point(), get_point(), get_point()};
+		}
+
+		// Zero-area, collinear and repeated triangles
+		vertices get_degenerate_triangle(const vertices& previous) {
+			fvec3 a = get_point();
+			fvec3 b = get_point();
+
+			switch (rng() % 4) {
+			case 0:
+				return {a, a, a};
+			case 1:
+				return {a, b, b};
+			case 2:
+				return {a, b, a + (b - a) * 0.5F};
+			default:
+				return previous;
+			}
+		}
+
+		geometry::triangle_packet get_packet(bool degenerate) {
+			geometry::triangle_packet packet;
+			uint32_t count = 1 + rng() % geometry::triangle_packet::width;
+
+			vertices previous = get_triangle();
+			for (uint32_t lane = 0; lane < count; lane++) {
+				if (degenerate && rng() % 2)
+					previous = get_degenerate_triangle(previous);
+				else
+					previous = get_triangle();
+
+				packet.add(geometry::triangle(previous[0], previous[1], previous[2]), lane);
+			}
+
+			return packet;
+		}
+
+		// Mostly aimed at a point of one of the triangles, so that lanes actually hit
+		geometry::ray get_ray(const geometry::triangle_packet& packet) {
+			fvec3 origin = get_point() * 4;
+
+			if (rng() % 4 == 0)
+				return geometry::ray(origin, get_point());
+
+			uint32_t lane = rng() % packet.count;
+			std::uniform_real_distribution<float> weight{-0.1F, 1.1F};
+			float beta = weight(rng);
+			float gamma = weight(rng);
+
+			fvec3 a(packet.ax[lane], packet.ay[lane], packet.az[lane]);
+			fvec3 b(packet.bx[lane], packet.by[lane], packet.bz[lane]);
+			fvec3 c(packet.cx[lane], packet.cy[lane], packet.cz[lane]);
+			fvec3 target = a * (1 - beta - gamma) + b * beta + c * gamma;
+
+			return geometry::ray(origin, target - origin);
+		}
+	};
+}
+
+TEST(triangle_packet, kernels_match_scalar_on_random_packets) {
+	random_packets random;
+
+	for (uint32_t i = 0; i < packet_count; i++) {
+		auto packet = random.get_packet(false);
+
+		for (uint32_t j = 0; j < rays_per_packet; j++)
+			expect_kernels_match(packet, random.get_ray(packet), std::numeric_limits<float>::infinity());
+	}
+}
+
+TEST(triangle_packet, kernels_match_scalar_on_degenerate_triangles) {
+	random_packets random;
+
+	for (uint32_t i = 0; i < packet_count; i++) {
+		auto packet = random.get_packet(true);
+
+		for (uint32_t j = 0; j < rays_per_packet; j++)
+			expect_kernels_match(packet, random.get_ray(packet), std::numeric_limits<float>::infinity());
+	}
+}
+
+TEST(triangle_packet, kernels_match_scalar_on_rays_in_the_triangle_plane) {
+	fvec3 a(0, 0, 0), b(1, 0, 0), c(0, 1, 0);
+	fvec3 offset(0, 0, 1);
+
+	geometry::triangle_packet packet;
+	packet.add(geometry::triangle(a, b, c), 0);
+	packet.add(geometry::triangle(a + offset, b + offset, c + offset), 1);
+
+	expect_kernels_match(packet, geometry::ray(fvec3(-1, 0.25F, 0), fvec3(1, 0, 0)), 10);
+	expect_kernels_match(packet, geometry::ray(fvec3(0.25F, 0.25F, 0), fvec3(0, 1, 0)), 10);
+	expect_kernels_match(packet, geometry::ray(fvec3(0.25F, 0.25F, -1), fvec3(0, 0, 1)), 10);
+}
+
+TEST(triangle_packet, kernels_match_scalar_around_max_dist) {
+	random_packets random;
+	const float inf = std::numeric_limits<float>::infinity();
+
+	for (uint32_t i = 0; i < packet_count; i++) {
+		auto packet = random.get_packet(i % 2 == 1);
+		auto ray = random.get_ray(packet);
+
+		auto nearest = packet.intersect(ray, inf, kernel::scalar);
+		float distance = nearest.has_hit() ? nearest.distance : 1;
+
+		for (float max_dist : {distance, std::nextafter(distance, 0.0F), std::nextafter(distance, inf), 0.0F, -0.0F, -1.0F, inf})
+			expect_kernels_match(packet, ray, max_dist);
+	}
+}
+
+TEST(triangle_packet, default_kernel_matches_scalar) {
+	random_packets random;
+
+	for (uint32_t i = 0; i < packet_count; i++) {
+		auto packet = random.get_packet(i % 2 == 1);
+		auto ray = random.get_ray(packet);
+
+		auto expected = packet.intersect(ray, 10, kernel::scalar);
+		auto actual = packet.intersect(ray, 10);
+
+		ASSERT_EQ(get_bits(expected.distance), get_bits(actual.distance));
+		if (expected.has_hit()) {
+			EXPECT_EQ(expected.lane, actual.lane);
+		}
+	}
+}